@@ -0,0 +1,331 @@
+/* ocr_async.h
+ *
+ * This file is part of OCR.
+ *
+ * Copyright 2012 David B. Knoester.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _OCR_ASYNC_H_
+#define _OCR_ASYNC_H_
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <vector>
+#include <ea/meta_data.h>
+#include <ea/generational_models/death_birth_process.h>
+#include "ocr_game.h"
+#include "ocr_numa.h"
+#include "ocr_surrogate.h"
+
+LIBEA_MD_DECL(ASYNC_THREADS, "ea.generational_model.async.threads", unsigned int);
+LIBEA_MD_DECL(ASYNC_STALENESS, "ea.generational_model.async.staleness", unsigned int);
+LIBEA_MD_DECL(ASYNC_NUMA, "ea.generational_model.async.numa", int);
+
+/*! Pool of threads that calculate the fitness of offspring in the background.
+
+ Offspring are submitted tagged with the update they were born in; they are
+ handed back (in submission order) once their fitness has been calculated.
+
+ If NUMA placement is on, workers are pinned to cpus dealt round-robin across
+ the machine's NUMA nodes, and on machines with more than one node, each node
+ gets its own replica of the game's image database.  The replica is copied by
+ the first worker to run on that node, after it has been pinned, so that its
+ pages are allocated (first-touch) in that node's memory.  Networks are built by
+ the worker that evaluates them, and so are already node-local.  A worker that
+ can't be pinned may run on any node, so it plays from the shared game instead;
+ a warning is printed the first time this happens.
+ */
+template <typename EA>
+class evaluation_pool {
+public:
+    typedef typename EA::individual_ptr_type individual_ptr_type; //!< Type of pointer to individual.
+
+    //! An offspring waiting for, or done with, fitness evaluation.
+    struct job {
+        job(individual_ptr_type i, unsigned long b, unsigned long s) : ind(i), born(b), seq(s) {
+        }
+
+        //! Order jobs by submission.
+        bool operator<(const job& that) const {
+            return seq < that.seq;
+        }
+
+        individual_ptr_type ind; //!< offspring
+        unsigned long born; //!< update this offspring was born in
+        unsigned long seq; //!< submission sequence number
+    };
+
+    typedef std::vector<job> job_list; //!< Type for a list of jobs.
+
+    //! Constructor.
+    evaluation_pool() : _ea(0), _batch(1), _numa(false), _pin_warned(0), _seq(0), _inflight(0), _stop(false) {
+    }
+
+    //! Destructor; waits for the workers to finish their current evaluations.
+    ~evaluation_pool() {
+        {
+            boost::mutex::scoped_lock lock(_mutex);
+            _stop = true;
+        }
+        _pending_cv.notify_all();
+        _workers.join_all();
+    }
+
+    //! Returns true if the workers have been started.
+    bool started() {
+        return _ea != 0;
+    }
+
+    /*! Start n worker threads that evaluate individuals in ea.  If batch > 1,
+     each worker takes up to batch individuals at a time and evaluates them
+     together with the fitness function's evaluate_batch.  If numa is true,
+     workers are placed as described above.
+     */
+    void start(std::size_t n, std::size_t batch, bool numa, EA& ea) {
+        _ea = &ea;
+        _batch = std::max<std::size_t>(batch, 1);
+        _numa = numa;
+        _replicas.resize(_topology.num_nodes());
+        for(std::size_t i=0; i<n; ++i) {
+            _workers.create_thread(boost::bind(&evaluation_pool::worker, this, i));
+        }
+    }
+
+    //! Submit individuals [f,l), born in update u, for evaluation.
+    template <typename ForwardIterator>
+    void submit(ForwardIterator f, ForwardIterator l, unsigned long u) {
+        {
+            boost::mutex::scoped_lock lock(_mutex);
+            for( ; f!=l; ++f) {
+                _pending.push_back(job(*f, u, _seq++));
+                ++_inflight;
+            }
+        }
+        _pending_cv.notify_all();
+    }
+
+    /*! Append all evaluated jobs to done, first waiting until every job born
+     at least staleness updates before update u has been evaluated.
+     */
+    void collect(job_list& done, unsigned long u, unsigned long staleness) {
+        boost::mutex::scoped_lock lock(_mutex);
+        for(unsigned long b=oldest_unfinished(); (b != std::numeric_limits<unsigned long>::max()) && ((b + staleness) <= u); b=oldest_unfinished()) {
+            _done_cv.wait(lock);
+        }
+        std::sort(_done.begin(), _done.end());
+        done.insert(done.end(), _done.begin(), _done.end());
+        _inflight -= _done.size();
+        _done.clear();
+    }
+
+protected:
+    //! Returns the birth update of the oldest job not yet evaluated (caller must hold the lock).
+    unsigned long oldest_unfinished() {
+        if(_inflight == _done.size()) {
+            return std::numeric_limits<unsigned long>::max();
+        }
+        unsigned long u=std::numeric_limits<unsigned long>::max();
+        for(typename std::deque<job>::iterator i=_pending.begin(); i!=_pending.end(); ++i) {
+            u = std::min(u, i->born);
+        }
+        for(typename std::vector<unsigned long>::iterator i=_running.begin(); i!=_running.end(); ++i) {
+            u = std::min(u, *i);
+        }
+        return u;
+    }
+
+    /*! Returns the replica of the game for node n, making it if needed; must
+     be called from a thread pinned to node n.
+     */
+    games::ocr_game& replica(std::size_t n) {
+        boost::mutex::scoped_lock lock(_replica_mutex);
+        if(!_replicas[n]) {
+            _replicas[n].reset(new games::ocr_game(_ea->fitness_function().game));
+        }
+        return *_replicas[n];
+    }
+    
+    //! Worker thread k; evaluates pending jobs until stopped.
+    void worker(std::size_t k) {
+        games::ocr_game* game=&_ea->fitness_function().game;
+        if(_numa) {
+            if(games::pin_this_thread(_topology.cpu_of(k))) {
+                if(_topology.num_nodes() > 1) {
+                    game = &replica(_topology.node_of(k));
+                }
+            } else if(__sync_bool_compare_and_swap(&_pin_warned, 0, 1)) {
+                std::cerr << "evaluation_pool: could not pin worker to cpu " << _topology.cpu_of(k)
+                << "; unpinned workers use the shared game" << std::endl;
+            }
+        }
+        
+        for(;;) {
+            boost::mutex::scoped_lock lock(_mutex);
+            while(_pending.empty() && !_stop) {
+                _pending_cv.wait(lock);
+            }
+            if(_stop) {
+                return;
+            }
+            job_list batch;
+            while(!_pending.empty() && (batch.size() < _batch)) {
+                batch.push_back(_pending.front());
+                _pending.pop_front();
+                _running.push_back(batch.back().born);
+            }
+            lock.unlock();
+
+            try {
+                if(batch.size() == 1) {
+                    batch[0].ind->fitness() = _ea->fitness_function().evaluate(*batch[0].ind, *game, *_ea);
+                } else {
+                    std::vector<individual_ptr_type> inds;
+                    for(typename job_list::iterator i=batch.begin(); i!=batch.end(); ++i) {
+                        inds.push_back(i->ind);
+                    }
+                    _ea->fitness_function().evaluate_batch(inds.begin(), inds.end(), *game, *_ea);
+                }
+            } catch(std::exception& e) {
+                // the jobs must still be done, or collect() would wait for them
+                // forever; give them a fitness that never outranks another's:
+                std::cerr << "evaluation_pool: " << e.what() << std::endl;
+                for(typename job_list::iterator i=batch.begin(); i!=batch.end(); ++i) {
+                    i->ind->fitness() = surrogate_model::screened_fitness();
+                }
+            }
+
+            lock.lock();
+            for(typename job_list::iterator i=batch.begin(); i!=batch.end(); ++i) {
+                _running.erase(std::find(_running.begin(), _running.end(), i->born));
+                _done.push_back(*i);
+            }
+            _done_cv.notify_all();
+        }
+    }
+
+    EA* _ea; //!< EA whose individuals are being evaluated
+    std::size_t _batch; //!< maximum number of individuals a worker evaluates at once
+    bool _numa; //!< true if workers are pinned and the game replicated per node
+    int _pin_warned; //!< 1 once a worker has warned that it couldn't be pinned
+    games::numa_topology _topology; //!< NUMA topology of this machine
+    std::vector<boost::shared_ptr<games::ocr_game> > _replicas; //!< per-node replicas of the game
+    boost::mutex _replica_mutex; //!< protects _replicas
+    unsigned long _seq; //!< next submission sequence number
+    std::size_t _inflight; //!< number of jobs submitted but not yet collected
+    bool _stop; //!< true when the workers should exit
+    std::deque<job> _pending; //!< jobs waiting for a worker
+    std::vector<unsigned long> _running; //!< birth updates of jobs being evaluated
+    job_list _done; //!< evaluated jobs waiting to be collected
+    boost::mutex _mutex; //!< protects all of the above
+    boost::condition_variable _pending_cv; //!< signaled when jobs are submitted
+    boost::condition_variable _done_cv; //!< signaled when a job is done
+    boost::thread_group _workers; //!< worker threads
+};
+
+
+/*! Asynchronous, steady-state variant of the death-birth process.
+
+ Each update, offspring are selected, recombined, and mutated on the main
+ thread and then handed to a pool of worker threads for fitness evaluation.
+ Instead of waiting for them, the update replaces individuals with whichever
+ offspring have finished; evaluation thus overlaps with selection, with the
+ statistics events, and with the next update's breeding.  Staleness bounds the
+ pipeline: offspring born in update u are guaranteed to be in the population by
+ the end of update u+staleness, so at most (staleness+1) updates' worth of
+ offspring are in flight.
+
+ If game.ocr.tile.networks > 1, offspring are evaluated in batches of that
+ size, image-major; see games::ocr_game::play_tiled.  With async.numa=1,
+ workers are NUMA-aware; see evaluation_pool.
+
+ With async.threads=0, offspring are evaluated on the main thread, and this is
+ the death-birth process; with tile.networks=1 as well, it is exactly ealib's
+ death_birth_process.  With
+ async.staleness=0 it is synchronous, but evaluation is still parallel.  Note
+ that with staleness > 0 which offspring are ready at a given update depends on
+ timing, and so runs are no longer exactly repeatable.  The hard-example
+ sampler requires staleness=0, as offspring still in flight when the sample
+ changes would otherwise be scored on the old one.
+ */
+struct async_death_birth_process : public generational_models::death_birth_process {
+
+    //! Apply this generational model to the population.
+    template <typename Population, typename EA>
+    void operator()(Population& population, EA& ea) {
+        if(get<ASYNC_THREADS>(ea) == 0) {
+            if(get<GAME_OCR_TILE_NETWORKS>(ea) <= 1) {
+                generational_models::death_birth_process::operator()(population, ea);
+                return;
+            }
+            
+            // breed as below, but evaluate offspring here, in tiled batches:
+            Population offspring;
+            breed(population, offspring, ea);
+            std::size_t b=get<GAME_OCR_TILE_NETWORKS>(ea);
+            for(typename Population::iterator i=offspring.begin(); i!=offspring.end(); ) {
+                typename Population::iterator j=i + std::min<std::size_t>(b, offspring.end() - i);
+                ea.fitness_function().evaluate_batch(i, j, ea.fitness_function().game, ea);
+                i = j;
+            }
+            for(typename Population::iterator i=offspring.begin(); i!=offspring.end(); ++i) {
+                population[ea.rng()(population.size())] = *i;
+            }
+            return;
+        }
+
+        typedef evaluation_pool<EA> pool_type;
+        if(!_pool) {
+            _pool.reset(new pool_type());
+        }
+        pool_type& pool=*boost::static_pointer_cast<pool_type>(_pool);
+        if(!pool.started()) {
+            pool.start(get<ASYNC_THREADS>(ea), get<GAME_OCR_TILE_NETWORKS>(ea), get<ASYNC_NUMA>(ea) != 0, ea);
+        }
+
+        // breed this update's offspring, and send them off for evaluation:
+        Population offspring;
+        breed(population, offspring, ea);
+
+        unsigned long u = ea.current_update();
+        pool.submit(offspring.begin(), offspring.end(), u);
+
+        // replace random individuals with whatever is done, waiting only for
+        // offspring that have reached the staleness bound:
+        typename pool_type::job_list done;
+        pool.collect(done, u, get<ASYNC_STALENESS>(ea));
+        for(typename pool_type::job_list::iterator i=done.begin(); i!=done.end(); ++i) {
+            population[ea.rng()(population.size())] = i->ind;
+        }
+    }
+
+    //! Select, recombine, and mutate this update's offspring from population.
+    template <typename Population, typename EA>
+    void breed(Population& population, Population& offspring, EA& ea) {
+        std::size_t n = static_cast<std::size_t>(get<REPLACEMENT_RATE_P>(ea) * population.size());
+        Population parents;
+        select_n<selection::tournament>(population, parents, n, ea);
+        recombine_n(parents, offspring, typename EA::recombination_operator_type(), n, ea);
+        mutate(offspring.begin(), offspring.end(), ea);
+    }
+
+    boost::shared_ptr<void> _pool; //!< evaluation pool; type-erased as it depends on the EA
+};
+
+#endif
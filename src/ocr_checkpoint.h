@@ -0,0 +1,544 @@
+/* ocr_checkpoint.h
+ *
+ * This file is part of OCR.
+ *
+ * Copyright 2012 David B. Knoester.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _OCR_CHECKPOINT_H_
+#define _OCR_CHECKPOINT_H_
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/cstdint.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+#include <ea/meta_data.h>
+#include <ea/exceptions.h>
+#include "ocr_rng.h"
+
+LIBEA_MD_DECL(BINARY_CHECKPOINT_PERIOD, "ea.run.binary_checkpoint.period", unsigned int);
+LIBEA_MD_DECL(BINARY_CHECKPOINT_KEYFRAME, "ea.run.binary_checkpoint.keyframe", unsigned int);
+LIBEA_MD_DECL(BINARY_CHECKPOINT_COMPRESS, "ea.run.binary_checkpoint.compress", int);
+LIBEA_MD_DECL(BINARY_CHECKPOINT_UPDATE_OFFSET, "ea.run.binary_checkpoint.update_offset", unsigned long);
+
+/* Binary, incremental checkpoints.
+
+ A binary checkpoint holds only what's needed to restart: each individual's
+ genome and generation, a seed for the EA's rng, and any state the fitness
+ function keeps outside of the population (see bcp_save_state).  Everything
+ else (fitness, ROC metadata) is recomputed on restart.  Game evaluation is
+ keyed on the genome and generation, so this reproduces an individual's results
+ on the same images.  With the hard-example sampler, the sampler's tallies and
+ current sample are saved as fitness function state, and the population is
+ rescored on that sample.  Runs that screen with the surrogate can't be
+ checkpointed, as whether an individual was screened depends on the history of
+ the surrogate.
+
+ Genomes are stored as lists of segments, one per view of a cow_genome (see
+ ocr_genome.h).  Views are what offspring share with their parents, so two
+ genomes that differ by a few mutations differ in only a few segments.  Each
+ segment is written once, keyed by a hash of its sites, and referred to by
+ (origin, offset), where origin is the update of the checkpoint file that holds
+ it.  A segment that was already written by an earlier checkpoint is not
+ written again.  Every keyframe-th checkpoint writes all of its segments, so
+ that files before it are no longer needed.
+
+ File layout (host byte order, 8-byte aligned):
+   bcp_header
+   bcp_entry[count]
+   bcp_segment[nsegments]; entry i's segments are [first, first+nsegs)
+   fitness function state, state_bytes long
+   data for segments that are new in this checkpoint
+
+ Uncompressed sites are stored as a raw array of 32-bit words so that they can
+ be used directly from the mapped file; compressed sites are stored as LEB128
+ varints, roughly halving their size for typical HMM genomes.
+
+ Each time a checkpoint is due, a seed is drawn from the EA's rng, and the rng
+ is reseeded with it; the seed is stored in the checkpoint, so that a run
+ restarted from it proceeds as the original run did.  Checkpoint files are
+ never overwritten.
+ */
+
+//! Header of a binary checkpoint.
+struct bcp_header {
+    char magic[4]; //!< "OCRB"
+    boost::uint32_t version; //!< format version
+    boost::uint64_t update; //!< update at which this checkpoint was taken
+    boost::uint64_t count; //!< number of individuals
+    boost::uint64_t nsegments; //!< number of segment references
+    boost::uint64_t state_bytes; //!< size of the fitness function's state
+    boost::uint32_t seed; //!< seed of the EA's rng after this checkpoint
+    boost::uint32_t reserved; //!< padding
+};
+
+//! Per-individual entry of a binary checkpoint.
+struct bcp_entry {
+    boost::uint64_t id; //!< genome id
+    boost::uint64_t first; //!< index of the individual's first segment
+    boost::uint32_t nsegs; //!< number of segments
+    boost::uint32_t nsites; //!< number of sites
+    boost::uint32_t generation; //!< generation of the individual
+    boost::uint32_t reserved; //!< padding
+};
+
+//! Reference to the sites of a segment.
+struct bcp_segment {
+    boost::uint64_t origin; //!< update of the checkpoint file holding the sites
+    boost::uint64_t offset; //!< offset of the sites in that file's data
+    boost::uint32_t nsites; //!< number of sites
+    boost::uint32_t bytes; //!< number of bytes of encoded sites
+    boost::uint32_t compressed; //!< 1 if sites are varint-encoded
+    boost::uint32_t reserved; //!< padding
+};
+
+/*! Hooks for fitness functions to save state that isn't held by the population
+ (e.g., a novelty archive) in binary checkpoints, and to restore it; by default,
+ there is none.  Fitness functions that have such state provide overloads.
+ bcp_save_state is called on the main thread, between updates.
+ */
+template <typename FitnessFunction>
+void bcp_save_state(FitnessFunction&, std::string&) {
+}
+
+//! Restore state saved by bcp_save_state; see above.
+template <typename FitnessFunction>
+void bcp_load_state(FitnessFunction&, const std::string&) {
+}
+
+/*! Hook for fitness functions to recalculate the fitness of every individual
+ in the population, used on restart and whenever the images that fitness is
+ measured on change (see hard_example_sampler).  By default, fitness is only
+ calculated for individuals that don't have one.
+ */
+template <typename FitnessFunction, typename EA>
+void rescore_population(FitnessFunction&, EA& ea) {
+    calculate_fitness(ea.population().begin(), ea.population().end(), ea);
+}
+
+/*! Returns the current update, counted from the start of the run rather than
+ from the last restart.
+ */
+template <typename EA>
+unsigned long run_update(EA& ea) {
+    return get<BINARY_CHECKPOINT_UPDATE_OFFSET>(ea) + ea.current_update();
+}
+
+//! Returns the filename of the binary checkpoint with the given prefix and update.
+inline std::string bcp_filename(const std::string& prefix, boost::uint64_t update) {
+    return prefix + "-" + boost::lexical_cast<std::string>(update) + ".bin";
+}
+
+//! Returns n rounded up to a multiple of 8.
+inline std::size_t bcp_align(std::size_t n) {
+    return (n + 7) & ~static_cast<std::size_t>(7);
+}
+
+//! Read-only memory map of a binary checkpoint.
+class bcp_mapped_file {
+public:
+    //! Constructor; throws if the file isn't a binary checkpoint.
+    bcp_mapped_file(const std::string& filename) : _filename(filename), _data(0), _size(0) {
+        int fd=open(filename.c_str(), O_RDONLY);
+        if(fd < 0) {
+            throw ea::file_io_exception("could not open: " + filename + " for reading");
+        }
+        struct stat st;
+        if(fstat(fd, &st) != 0) {
+            close(fd);
+            throw ea::file_io_exception("could not stat: " + filename);
+        }
+        _size = st.st_size;
+        void* p=mmap(0, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(p == MAP_FAILED) {
+            throw ea::file_io_exception("could not map: " + filename);
+        }
+        _data = static_cast<const char*>(p);
+        
+        const bcp_header* h=header();
+        // check the counts one by one first, so that data_offset can't overflow:
+        if((_size < sizeof(bcp_header)) || (std::string(h->magic, 4) != "OCRB") || (h->version != 2)
+           || (h->count > _size/sizeof(bcp_entry)) || (h->nsegments > _size/sizeof(bcp_segment)) || (h->state_bytes > _size)
+           || (_size < data_offset())) {
+            munmap(const_cast<char*>(_data), _size);
+            throw ea::file_io_exception("not a binary checkpoint: " + filename);
+        }
+    }
+
+    //! Destructor.
+    ~bcp_mapped_file() {
+        munmap(const_cast<char*>(_data), _size);
+    }
+
+    //! Returns the header.
+    const bcp_header* header() {
+        return reinterpret_cast<const bcp_header*>(_data);
+    }
+    
+    //! Returns the entries.
+    const bcp_entry* entries() {
+        return reinterpret_cast<const bcp_entry*>(_data + sizeof(bcp_header));
+    }
+    
+    //! Returns the segment references.
+    const bcp_segment* segments() {
+        return reinterpret_cast<const bcp_segment*>(_data + sizeof(bcp_header) + header()->count*sizeof(bcp_entry));
+    }
+    
+    //! Returns the fitness function's state.
+    std::string state() {
+        return std::string(_data + sizeof(bcp_header) + header()->count*sizeof(bcp_entry) + header()->nsegments*sizeof(bcp_segment), header()->state_bytes);
+    }
+    
+    //! Returns a pointer to the bytes of segment data at offset; throws if they're past the end of the file.
+    const char* data(boost::uint64_t offset, boost::uint64_t bytes) {
+        std::size_t n=_size - data_offset();
+        if((offset > n) || (bytes > (n - offset))) {
+            throw ea::file_io_exception("corrupt binary checkpoint: " + _filename);
+        }
+        return _data + data_offset() + offset;
+    }
+
+protected:
+    //! Returns the offset of the segment data in the file.
+    std::size_t data_offset() {
+        return sizeof(bcp_header) + header()->count*sizeof(bcp_entry) + header()->nsegments*sizeof(bcp_segment) + bcp_align(header()->state_bytes);
+    }
+    
+    std::string _filename; //!< name of the mapped file
+    const char* _data; //!< mapped data
+    std::size_t _size; //!< size of the mapping
+};
+
+/*! Writes binary checkpoints of the population from a background thread.
+
+ Each checkpoint period, the population's individual pointers are copied and
+ handed to the writer.  Individuals are never modified once they're in the
+ population (offspring replace them), so this copy is a copy-on-write snapshot
+ of the whole population.  If the writer is still busy with the previous
+ checkpoint, this one is skipped rather than stalling evolution.  Errors are
+ reported, and skip the checkpoint, rather than ending the run.
+ */
+template <typename EA>
+struct binary_checkpoint : end_of_update_event<EA> {
+    typedef std::vector<typename EA::individual_ptr_type> snapshot_type; //!< Type of a population snapshot.
+
+    //! Location of segments in this and previous checkpoints, by hash.
+    typedef std::map<boost::uint64_t, bcp_segment> index_type;
+
+    binary_checkpoint(EA& ea) : end_of_update_event<EA>(ea), _n(0), _busy(false), _stop(false) {
+    }
+
+    virtual ~binary_checkpoint() {
+        {
+            boost::mutex::scoped_lock lock(_mutex);
+            while(_busy) {
+                _cv.wait(lock);
+            }
+            _stop = true;
+        }
+        _cv.notify_all();
+        if(_thread) {
+            _thread->join();
+        }
+    }
+
+    virtual void operator()(EA& ea) {
+        unsigned long u=run_update(ea);
+        if((get<BINARY_CHECKPOINT_PERIOD>(ea) == 0) || ((u % get<BINARY_CHECKPOINT_PERIOD>(ea)) != 0)) {
+            return;
+        }
+
+        // reseed whether or not this checkpoint is written, so that the rng
+        // doesn't depend on how busy the writer was:
+        boost::uint32_t seed=static_cast<boost::uint32_t>(ea.rng()(std::numeric_limits<int>::max()));
+        ea.rng().reset(seed);
+        
+        {
+            boost::mutex::scoped_lock lock(_mutex);
+            if(_busy) {
+                return;
+            }
+            _snapshot.assign(ea.population().begin(), ea.population().end());
+            _state.clear();
+            bcp_save_state(ea.fitness_function(), _state);
+            _update = u;
+            _seed = seed;
+            _keyframe = (get<BINARY_CHECKPOINT_KEYFRAME>(ea) == 0) || ((_n++ % get<BINARY_CHECKPOINT_KEYFRAME>(ea)) == 0);
+            _busy = true;
+        }
+
+        if(!_thread) {
+            _thread.reset(new boost::thread(boost::bind(&binary_checkpoint::writer, this, get<CHECKPOINT_PREFIX>(ea), get<BINARY_CHECKPOINT_COMPRESS>(ea) != 0)));
+        }
+        _cv.notify_all();
+    }
+
+    //! Background thread; writes snapshots until stopped.
+    void writer(std::string prefix, bool compress) {
+        for(;;) {
+            {
+                boost::mutex::scoped_lock lock(_mutex);
+                while(!_busy && !_stop) {
+                    _cv.wait(lock);
+                }
+                if(_stop) {
+                    return;
+                }
+            }
+
+            try {
+                write(prefix, compress);
+            } catch(std::exception& e) {
+                std::cerr << "binary_checkpoint: " << e.what() << std::endl;
+                _index.clear(); // the next checkpoint can't refer to this one
+            }
+
+            {
+                boost::mutex::scoped_lock lock(_mutex);
+                _snapshot.clear(); // release our references to the individuals
+                _state.clear();
+                _busy = false;
+            }
+            _cv.notify_all();
+        }
+    }
+
+    //! Write the current snapshot.
+    void write(const std::string& prefix, bool compress) {
+        if(_keyframe) {
+            _index.clear();
+        }
+
+        std::vector<bcp_entry> entries(_snapshot.size());
+        std::vector<bcp_segment> segments;
+        std::vector<char> data;
+        index_type next;
+
+        for(std::size_t i=0; i<_snapshot.size(); ++i) {
+            typename EA::representation_type& repr=_snapshot[i]->repr();
+            bcp_entry& e=entries[i];
+            e.id = games::genome_id(repr.begin(), repr.end());
+            e.first = segments.size();
+            e.nsegs = repr.num_views();
+            e.nsites = repr.size();
+            e.generation = static_cast<boost::uint32_t>(_snapshot[i]->generation());
+            e.reserved = 0;
+
+            for(std::size_t h=0; h<repr.num_views(); ++h) {
+                std::size_t n=0;
+                const typename EA::representation_type::value_type* sites=repr.view_sites(h, n);
+                boost::uint64_t key=games::genome_id(sites, sites+n) * 31 + n;
+                
+                typename index_type::iterator j=next.find(key);
+                bool found=(j != next.end());
+                if(!found) {
+                    j = _index.find(key);
+                    found = (j != _index.end());
+                }
+                
+                bcp_segment s;
+                if(found) {
+                    // already written; point at the older copy:
+                    s = j->second;
+                } else {
+                    // new segment; append its sites to this checkpoint:
+                    s.origin = _update;
+                    s.offset = data.size();
+                    s.nsites = n;
+                    s.compressed = compress;
+                    s.reserved = 0;
+                    for(std::size_t k=0; k<n; ++k) {
+                        boost::uint32_t x=static_cast<boost::uint32_t>(sites[k]);
+                        if(compress) {
+                            for( ; x >= 0x80; x >>= 7) {
+                                data.push_back(static_cast<char>((x & 0x7f) | 0x80));
+                            }
+                            data.push_back(static_cast<char>(x));
+                        } else {
+                            data.insert(data.end(), reinterpret_cast<char*>(&x), reinterpret_cast<char*>(&x)+sizeof(x));
+                        }
+                    }
+                    s.bytes = data.size() - s.offset;
+                    data.resize(bcp_align(data.size())); // align the next segment
+                }
+                next[key] = s;
+                segments.push_back(s);
+            }
+        }
+
+        bcp_header h;
+        h.magic[0]='O'; h.magic[1]='C'; h.magic[2]='R'; h.magic[3]='B';
+        h.version = 2;
+        h.update = _update;
+        h.count = entries.size();
+        h.nsegments = segments.size();
+        h.state_bytes = _state.size();
+        h.seed = _seed;
+        h.reserved = 0;
+
+        // write to a temporary file, and then link it into place so that a
+        // partial checkpoint is never mistaken for a complete one, and an 
+        // existing checkpoint (which later ones may refer to) is never replaced:
+        std::string filename=bcp_filename(prefix, _update);
+        std::string tmp=filename + ".tmp";
+        std::ofstream out(tmp.c_str(), std::ios::binary);
+        out.write(reinterpret_cast<char*>(&h), sizeof(h));
+        if(!entries.empty()) {
+            out.write(reinterpret_cast<char*>(&entries[0]), entries.size()*sizeof(bcp_entry));
+        }
+        if(!segments.empty()) {
+            out.write(reinterpret_cast<char*>(&segments[0]), segments.size()*sizeof(bcp_segment));
+        }
+        _state.resize(bcp_align(_state.size()));
+        out.write(_state.data(), _state.size());
+        if(!data.empty()) {
+            out.write(&data[0], data.size());
+        }
+        out.close();
+        if(!out.good()) {
+            unlink(tmp.c_str());
+            throw ea::file_io_exception("could not write: " + tmp);
+        }
+        if(link(tmp.c_str(), filename.c_str()) != 0) {
+            int err=errno;
+            unlink(tmp.c_str());
+            if(err == EEXIST) {
+                throw ea::file_io_exception("refusing to overwrite: " + filename);
+            }
+            throw ea::file_io_exception("could not create: " + filename);
+        }
+        unlink(tmp.c_str());
+
+        _index.swap(next);
+    }
+
+    unsigned int _n; //!< number of checkpoints taken
+    bool _busy; //!< true while the writer has a snapshot
+    bool _stop; //!< true when the writer should exit
+    bool _keyframe; //!< true if the current snapshot should be written in full
+    unsigned long _update; //!< update of the current snapshot
+    boost::uint32_t _seed; //!< rng seed of the current snapshot
+    snapshot_type _snapshot; //!< individuals to be written
+    std::string _state; //!< fitness function state to be written
+    index_type _index; //!< segments in the previous checkpoint; only used by the writer
+    boost::mutex _mutex; //!< protects _busy, _stop, and the snapshot
+    boost::condition_variable _cv; //!< signaled on a new snapshot, completion, or stop
+    boost::scoped_ptr<boost::thread> _thread; //!< writer thread
+};
+
+/*! Load the population from the given binary checkpoint, replacing the current
+ population, restore the fitness function's state, recalculate fitness, and
+ reseed the EA's rng as it was after the checkpoint.  Throws if the checkpoint,
+ or any file it refers to, is truncated or corrupt.  Returns the update at which
+ the checkpoint was taken.
+ */
+template <typename EA>
+unsigned long load_binary_checkpoint(const std::string& filename, EA& ea) {
+    typedef std::map<boost::uint64_t, boost::shared_ptr<bcp_mapped_file> > file_map;
+    file_map files;
+
+    boost::shared_ptr<bcp_mapped_file> f(new bcp_mapped_file(filename));
+    const bcp_header* h=f->header();
+    files[h->update] = f;
+    std::string prefix=filename.substr(0, filename.rfind('-'));
+
+    ea.population().clear();
+    const bcp_entry* e=f->entries();
+    for(std::size_t i=0; i<h->count; ++i, ++e) {
+        if((e->first > h->nsegments) || (e->nsegs > (h->nsegments - e->first))) {
+            throw ea::file_io_exception("corrupt binary checkpoint: " + filename);
+        }
+        typename EA::individual_ptr_type p(new typename EA::individual_type());
+        p->generation() = e->generation;
+        typename EA::representation_type& repr=p->repr();
+        
+        const bcp_segment* s=f->segments() + e->first;
+        for(std::size_t k=0; k<e->nsegs; ++k, ++s) {
+            typename file_map::iterator j=files.find(s->origin);
+            if(j == files.end()) {
+                j = files.insert(std::make_pair(s->origin, boost::shared_ptr<bcp_mapped_file>(new bcp_mapped_file(bcp_filename(prefix, s->origin))))).first;
+            }
+            
+            if(s->compressed) {
+                // varints are at most 5 bytes, and may not run past the segment:
+                const unsigned char* d=reinterpret_cast<const unsigned char*>(j->second->data(s->offset, s->bytes));
+                const unsigned char* end=d + s->bytes;
+                for(std::size_t m=0; m<s->nsites; ++m) {
+                    boost::uint32_t x=0;
+                    for(int shift=0; ; shift+=7, ++d) {
+                        if((d == end) || (shift > 28)) {
+                            throw ea::file_io_exception("corrupt binary checkpoint: " + bcp_filename(prefix, s->origin));
+                        }
+                        x |= static_cast<boost::uint32_t>(*d & 0x7f) << shift;
+                        if(!(*d & 0x80)) {
+                            ++d;
+                            break;
+                        }
+                    }
+                    repr.push_back(x);
+                }
+            } else {
+                if(s->bytes != (static_cast<boost::uint64_t>(s->nsites) * sizeof(boost::uint32_t))) {
+                    throw ea::file_io_exception("corrupt binary checkpoint: " + bcp_filename(prefix, s->origin));
+                }
+                const boost::uint32_t* d=reinterpret_cast<const boost::uint32_t*>(j->second->data(s->offset, s->bytes));
+                repr.insert(repr.end(), d, d + s->nsites);
+            }
+        }
+        if((repr.size() != e->nsites) || (games::genome_id(repr.begin(), repr.end()) != e->id)) {
+            throw ea::file_io_exception("corrupt binary checkpoint: " + filename);
+        }
+        ea.population().push_back(p);
+    }
+
+    // restore the fitness function's state before rescoring, which may depend
+    // on it, and again after, as rescoring may change it (e.g., tallies):
+    std::string state=f->state();
+    bcp_load_state(ea.fitness_function(), state);
+    rescore_population(ea.fitness_function(), ea);
+    bcp_load_state(ea.fitness_function(), state);
+    ea.rng().reset(h->seed);
+    return h->update;
+}
+
+/*! Restart a run from the binary checkpoint given by --analysis.input, and run
+ it to ea.run.updates.  Updates are counted from the checkpoint's, so that new
+ checkpoints follow on from the old ones rather than colliding with them.
+ */
+LIBEA_ANALYSIS_TOOL(binary_restart) {
+    unsigned long u=load_binary_checkpoint(get<ANALYSIS_INPUT>(ea), ea);
+    put<BINARY_CHECKPOINT_UPDATE_OFFSET>(u, ea);
+    if(u < get<RUN_UPDATES>(ea)) {
+        ea.advance_epoch(get<RUN_UPDATES>(ea) - u);
+    }
+}
+
+#endif
@@ -19,6 +19,8 @@
  */
 #include <arpa/inet.h>
 #include <boost/scoped_array.hpp>
+#include <cmath>
+#include <functional>
 #include <fstream>
 #include <set>
 #include <ea/algorithm.h>
@@ -26,9 +28,302 @@
 #include "ocr_game.h"
 
 
+/*! Append the k x k max-pooled version of the (binarized) rows x cols image 
+ img to e.  Partial blocks at the right and bottom edges are pooled as well.
+ */
+static void encode_pool(const games::ocr_game::labeled_image::image_type& img, unsigned int rows, unsigned int cols, unsigned int k, games::ocr_game::labeled_image::image_type& e) {
+    for(unsigned int r=0; r<rows; r+=k) {
+        for(unsigned int c=0; c<cols; c+=k) {
+            unsigned char on=0;
+            for(unsigned int i=r; (i<(r+k)) && (i<rows); ++i) {
+                for(unsigned int j=c; (j<(c+k)) && (j<cols); ++j) {
+                    on |= img[i*cols+j];
+                }
+            }
+            e.push_back(on);
+        }
+    }
+}
+
+/*! Append the row and column projections of the (binarized) rows x cols image
+ img to e.  A projection bit is on if its row (column) contains at least as many
+ on pixels as the mean row (column).
+ */
+static void encode_projection(const games::ocr_game::labeled_image::image_type& img, unsigned int rows, unsigned int cols, games::ocr_game::labeled_image::image_type& e) {
+    std::vector<unsigned int> rsum(rows,0), csum(cols,0);
+    unsigned int total=0;
+    for(unsigned int i=0; i<rows; ++i) {
+        for(unsigned int j=0; j<cols; ++j) {
+            rsum[i] += img[i*cols+j];
+            csum[j] += img[i*cols+j];
+            total += img[i*cols+j];
+        }
+    }
+    // compare x >= total/n as x*n >= total to stay in integers:
+    for(unsigned int i=0; i<rows; ++i) {
+        e.push_back((total > 0) && (rsum[i]*rows >= total));
+    }
+    for(unsigned int j=0; j<cols; ++j) {
+        e.push_back((total > 0) && (csum[j]*cols >= total));
+    }
+}
+
+/*! Encode the (binarized) rows x cols image img according to the given 
+ encoding; see ocr_game::initialize.
+ */
+static games::ocr_game::labeled_image::image_type encode(const games::ocr_game::labeled_image::image_type& img, unsigned int rows, unsigned int cols, const std::string& encoding) {
+    games::ocr_game::labeled_image::image_type e;
+    std::string::size_type b=0;
+    do {
+        std::string::size_type p=encoding.find('+', b);
+        std::string feature=encoding.substr(b, (p==std::string::npos) ? std::string::npos : p-b);
+        b = (p==std::string::npos) ? p : p+1;
+        
+        if(feature == "pixel") {
+            e.insert(e.end(), img.begin(), img.end());
+        } else if(feature == "pool2") {
+            encode_pool(img, rows, cols, 2, e);
+        } else if(feature == "pool4") {
+            encode_pool(img, rows, cols, 4, e);
+        } else if(feature == "proj") {
+            encode_projection(img, rows, cols, e);
+        } else {
+            throw ea::bad_argument_exception("unknown game.ocr.encoding feature: " + feature);
+        }
+    } while(b != std::string::npos);
+    return e;
+}
+
+
+/*! XOR-reduce Width outputs; unrolled at compile time.
+ */
+template <std::size_t Width>
+struct xor_n {
+    static int apply(const int* x) {
+        return x[0] ^ xor_n<Width-1>::apply(x+1);
+    }
+};
+
+template <>
+struct xor_n<1> {
+    static int apply(const int* x) {
+        return x[0];
+    }
+};
+
+/*! Decode the outputs for a single image and tally them into the ROC table.
+ 
+ Label j is "on" if the XOR of its Width output bits is non-zero.  All counters
+ of all labels are updated arithmetically, without branches, so that the loop
+ over the (compile-time) number of labels can be unrolled and vectorized.
+ */
+template <std::size_t Width, std::size_t Labels>
+static int decode_n(const int* outputs, unsigned int index, games::ocr_game::results::roc_table& roc) {
+    typedef games::ocr_game::results R;
+    int errors=0;
+    for(std::size_t j=0; j<Labels; ++j) {
+        int on = (xor_n<Width>::apply(outputs + j*Width) != 0);
+        int pos = (index == j);
+        R::roc_row& row=roc[j];
+        row[R::P] += pos;
+        row[R::N] += 1-pos;
+        row[R::TP] += pos & on;
+        row[R::FN] += pos & (1-on);
+        row[R::FP] += (1-pos) & on;
+        row[R::TN] += (1-pos) & (1-on);
+        errors += pos ^ on;
+    }
+    return errors;
+}
+
+/*! Select the specialized decoder for the given width, or null if there isn't 
+ one.
+ */
+template <std::size_t Labels>
+static games::ocr_game::decoder_type select_decoder(unsigned int width) {
+    switch(width) {
+        case 1: return &decode_n<1,Labels>;
+        case 2: return &decode_n<2,Labels>;
+        case 3: return &decode_n<3,Labels>;
+        case 4: return &decode_n<4,Labels>;
+        case 5: return &decode_n<5,Labels>;
+        case 6: return &decode_n<6,Labels>;
+        case 7: return &decode_n<7,Labels>;
+        case 8: return &decode_n<8,Labels>;
+        default: return 0;
+    }
+}
+
+/*! Decode outputs for an arbitrary label width and number of labels.
+ */
+int games::ocr_game::decode(const int* outputs, unsigned int index, results::roc_table& roc) {
+    int errors=0;
+    for(std::size_t j=0,k=0; j<_nlabels; ++j,k+=_width) {
+        int on = ea::algorithm::vxor(&outputs[k], &outputs[k+_width]);
+        
+        if(index == j) {
+            ++roc[j][results::P]; // positives
+            if(on) {
+                ++roc[j][results::TP]; // true positives
+            } else {
+                ++roc[j][results::FN]; // false negative
+            }
+        } else {
+            ++roc[j][results::N]; // negatives
+            if(on) {
+                ++roc[j][results::FP]; // false positives
+            } else {
+                ++roc[j][results::TN]; // true negative
+            }
+        }
+        errors += ((index == j) != (on != 0));
+    }
+    return errors;
+}
+
+
+/*! Play the game for a batch of networks, image-major; see ocr_game.h.
+ */
+void games::ocr_game::play_tiled(std::vector<fn::hmm::hmm_network*>& networks, const std::vector<counter_rng>& rngs,
+                                 std::size_t game_size, std::size_t updates, std::size_t tile_networks, std::size_t tile_images,
+                                 std::vector<results>& r) {
+    assert(networks.size() == rngs.size());
+    std::size_t n=networks.size();
+    
+    __sync_fetch_and_add(&_shared->plays, n);
+    
+    // all networks play the same images:
+    boost::shared_ptr<const results::index_vector> games=current_games();
+    results::index_vector idx;
+    if(games) {
+        idx.assign(games->begin(), games->end());
+    } else {
+        std::generate_n(std::back_inserter(idx), game_size, ea::series_generator<std::size_t>(0,1));
+    }
+    tile_networks = std::max<std::size_t>(tile_networks, 1);
+    tile_images = std::max<std::size_t>(tile_images, 1);
+    
+    // SoA ROC table, keyed by dense label index; positives depend only on the
+    // images, and tp[j*n+k] is the true positives of label j for network k:
+    std::vector<int> pos(_nlabels,0), tp(_nlabels*n,0), fp(_nlabels*n,0);
+    
+    std::vector<feature_vector> inputs(tile_images);
+    feature_vector outputs;
+    outputs.reserve(num_outputs());
+    
+    for(std::size_t ib=0; ib<idx.size(); ib+=tile_images) {
+        std::size_t ie=std::min(ib+tile_images, idx.size());
+        
+        // encode this block of images once, for all networks:
+        for(std::size_t i=ib; i<ie; ++i) {
+            labeled_image& li=_idb[idx[i]];
+            inputs[i-ib].assign(li.img.begin(), li.img.end());
+            ++pos[li.index];
+        }
+        
+        for(std::size_t nb=0; nb<n; nb+=tile_networks) {
+            std::size_t ne=std::min(nb+tile_networks, n);
+            for(std::size_t i=ib; i<ie; ++i) {
+                unsigned int index=_idb[idx[i]].index;
+                for(std::size_t k=nb; k<ne; ++k) {
+                    outputs.clear();
+                    gate_rng irng=gate_stream(rngs[k], idx[i]);
+                    networks[k]->update_n(updates, inputs[i-ib].begin(), inputs[i-ib].end(), std::back_inserter(outputs), irng);
+                    assert(outputs.size() == num_outputs());
+                    
+                    // decoded as in decode(), but into the SoA table:
+                    int errors=0;
+                    const int* out=&outputs[0];
+                    for(std::size_t j=0; j<_nlabels; ++j,out+=_width) {
+                        int on = (ea::algorithm::vxor(out, out+_width) != 0);
+                        int p = (index == j);
+                        tp[j*n+k] += p & on;
+                        fp[j*n+k] += (1-p) & on;
+                        errors += p ^ on;
+                    }
+                    if(games) {
+                        __sync_fetch_and_add(&_shared->trials[idx[i]], 1);
+                        __sync_fetch_and_add(&_shared->errors[idx[i]], errors > 0);
+                    }
+                }
+            }
+        }
+    }
+    
+    // and convert back into per-network results:
+    r.clear();
+    for(std::size_t k=0; k<n; ++k) {
+        r.push_back(results(0, _nlabels, ea::series_generator<std::size_t>(0,1)));
+        results& rk=r.back();
+        rk.idx = idx;
+        for(std::size_t j=0; j<_nlabels; ++j) {
+            int neg=static_cast<int>(idx.size()) - pos[j];
+            rk.roc[j][results::P] = pos[j];
+            rk.roc[j][results::N] = neg;
+            rk.roc[j][results::TP] = tp[j*n+k];
+            rk.roc[j][results::FP] = fp[j*n+k];
+            rk.roc[j][results::FN] = pos[j] - tp[j*n+k];
+            rk.roc[j][results::TN] = neg - fp[j*n+k];
+        }
+    }
+}
+
+
+/*! Draw a new sample of n images for subsequent games; see ocr_game.h.
+ 
+ Sampling is without replacement, using the keys u^(1/w) of Efraimidis & 
+ Spirakis: the n images with the largest keys are the sample.
+ */
+void games::ocr_game::resample(std::size_t n, double floor, counter_rng rng) {
+    std::vector<unsigned int>& trials=_shared->trials;
+    std::vector<unsigned int>& errors=_shared->errors;
+    if(trials.empty()) {
+        trials.resize(_idb.size(), 0);
+        errors.resize(_idb.size(), 0);
+    }
+    
+    std::vector<double> d(_idb.size());
+    double dsum=0.0;
+    for(std::size_t i=0; i<_idb.size(); ++i) {
+        // tallies are updated without a lock, so errors can briefly exceed trials:
+        double p = (static_cast<double>(errors[i]) + 1.0) / (static_cast<double>(trials[i]) + 2.0);
+        p = std::min(std::max(p, 0.0), 1.0);
+        d[i] = std::max(p * (1.0 - p), 0.0);
+        dsum += d[i];
+        
+        // age the tallies; racing with play() only loses a few counts:
+        __sync_fetch_and_sub(&errors[i], errors[i]/2);
+        __sync_fetch_and_sub(&trials[i], trials[i]/2);
+    }
+    
+    typedef std::pair<double, std::size_t> keyed_index;
+    std::vector<keyed_index> keys(_idb.size());
+    if(dsum <= 0.0) {
+        floor = 1.0; // no image is harder than any other; sample uniformly
+        dsum = 1.0;
+    }
+    for(std::size_t i=0; i<_idb.size(); ++i) {
+        // with floor=0, an image with d=0 would have w=0, and a NaN key:
+        double w = std::max(floor / static_cast<double>(_idb.size()) + (1.0 - floor) * d[i] / dsum, 1e-12);
+        keys[i] = std::make_pair(std::log(1.0 - rng.p()) / w, i); // log(u^(1/w)); 1-p() is in (0,1]
+    }
+    n = std::min(n, keys.size());
+    std::partial_sort(keys.begin(), keys.begin()+n, keys.end(), std::greater<keyed_index>());
+    
+    boost::shared_ptr<results::index_vector> games(new results::index_vector());
+    for(std::size_t i=0; i<n; ++i) {
+        games->push_back(keys[i].second);
+    }
+    std::sort(games->begin(), games->end());
+    
+    boost::mutex::scoped_lock lock(_shared->mutex);
+    _shared->games = games;
+}
+
+
 /*! Initialize this game.
  */
-void games::ocr_game::initialize(const std::string& lname, const std::string& iname, unsigned int width) {
+void games::ocr_game::initialize(const std::string& lname, const std::string& iname, unsigned int width, const std::string& encoding) {
     using namespace std;
     
     _width = width;
@@ -87,25 +382,47 @@ void games::ocr_game::initialize(const std::string& lname, const std::string& in
     ifs.read((char*)&cols, sizeof(cols));
     cols = ntohl(cols);
     
-    // read in the images, match them up with their labels, and figure out 
-    // how many labels we have (we need this to determine the number of outputs):
-    std::set<char> lset;
+    // figure out how many labels we have (we need this to determine the number
+    // of outputs), and map each label to a dense index; labels needn't start at
+    // 0 or be contiguous (e.g., EMNIST letters are 1..26):
+    std::set<unsigned char> lset(labels.get(), labels.get()+lrecords);
+    _labels.assign(lset.begin(), lset.end());
+    unsigned char lindex[256];
+    for(std::size_t i=0; i<_labels.size(); ++i) {
+        lindex[_labels[i]] = static_cast<unsigned char>(i);
+    }
+    
+    // read in the images, and match them up with their labels:
     boost::scoped_array<unsigned char> img(new unsigned char[rows*cols]);
 
     for(unsigned int i=0; i<irecords; ++i) {
-        lset.insert(labels[i]); // incrementally build up our label set...
         ifs.read(reinterpret_cast<char*>(img.get()), rows*cols); // read the image
         if(!ifs.good()) {
             throw ea::file_io_exception("could not read from: " + lname);
         }
 
-        // now, build the labeled_image struct:
-        _idb.push_back(labeled_image(labels[i], img.get(), rows*cols));
+        // now, build the labeled_image struct; the encoding is done once, here,
+        // so that playing the game only copies the (smaller) encoded inputs:
+        labeled_image li(labels[i], img.get(), rows*cols);
+        li.index = lindex[labels[i]];
+        if(encoding != "pixel") {
+            li.img = encode(li.img, rows, cols, encoding);
+        }
+        _idb.push_back(li);
     }
     assert(_idb.size() == irecords);
     
     // and figure out how many inputs and outputs the network needs:
-    _nin = rows*cols;
-    _nout = lset.size() * _width;
+    _nlabels = _labels.size();
+    _nin = _idb.empty() ? 0 : _idb[0].img.size();
+    _nout = _nlabels * _width;
+    
+    // finally, pick a decoder that is specialized for our geometry:
+    switch(_nlabels) {
+        case 10: _decode = select_decoder<10>(_width); break; // digits
+        case 26: _decode = select_decoder<26>(_width); break; // letters
+        case 47: _decode = select_decoder<47>(_width); break; // balanced emnist
+        default: _decode = 0; break;
+    }
 }
 
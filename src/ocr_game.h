@@ -24,6 +24,9 @@
 #include <boost/accumulators/statistics/stats.hpp>
 #include <boost/accumulators/statistics/mean.hpp>
 #include <boost/shared_array.hpp>
+#include <boost/array.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 #include <algorithm>
 #include <iterator>
 #include <functional>
@@ -32,10 +35,14 @@
 #include <vector>
 #include <set>
 #include <string.h>
+#include <boost/serialization/nvp.hpp>
+#include <boost/serialization/vector.hpp>
 #include <fn/hmm/hmm_network.h>
 #include <ea/meta_data.h>
 #include <ea/generators.h>
 #include <ea/algorithm.h>
+#include <ea/rng.h>
+#include "ocr_rng.h"
 
 LIBEA_MD_DECL(OCR_TPR, "individual.ocr.mean_tpr", double);
 LIBEA_MD_DECL(OCR_TNR, "individual.ocr.mean_tnr", double);
@@ -45,14 +52,34 @@ LIBEA_MD_DECL(OCR_OUT, "individual.ocr.unique_outputs", double);
 LIBEA_MD_DECL(OCR_ACC, "individual.ocr.mean_accuracy", double);
 LIBEA_MD_DECL(OCR_ORDER, "individual.ocr.order", double);
 LIBEA_MD_DECL(OCR_IMAGES, "individual.ocr.images", std::string);
+LIBEA_MD_DECL(OCR_SCREENED, "individual.ocr.screened", int);
 
 LIBEA_MD_DECL(GAME_SIZE, "game.ocr.size", int);
 LIBEA_MD_DECL(GAME_OCR_LABELS, "game.ocr.label_filename", std::string);
 LIBEA_MD_DECL(GAME_OCR_IMAGES, "game.ocr.image_filename", std::string);
 LIBEA_MD_DECL(GAME_OUTPUT_WIDTH, "game.ocr.output_width", unsigned int);
+LIBEA_MD_DECL(GAME_OCR_ENCODING, "game.ocr.encoding", std::string);
+LIBEA_MD_DECL(GAME_OCR_SAMPLER, "game.ocr.sampler", std::string);
+LIBEA_MD_DECL(GAME_OCR_SAMPLER_FLOOR, "game.ocr.sampler.floor", double);
+LIBEA_MD_DECL(GAME_OCR_TILE_NETWORKS, "game.ocr.tile.networks", unsigned int);
+LIBEA_MD_DECL(GAME_OCR_TILE_IMAGES, "game.ocr.tile.images", unsigned int);
+LIBEA_MD_DECL(GAME_OCR_TEST_LABELS, "game.ocr.test_label_filename", std::string);
+LIBEA_MD_DECL(GAME_OCR_TEST_IMAGES, "game.ocr.test_image_filename", std::string);
 
 namespace games {
     
+    /*! Type of rng that HMM gates are updated with.  Gates are polymorphic, and
+     are written against libea's rng, so counter_rng streams aren't handed to
+     them directly; instead, each image's substream seeds one of these.
+     */
+    typedef ea::default_rng_type gate_rng;
+    
+    //! Returns the gate rng for image i of stream rng.
+    inline gate_rng gate_stream(const counter_rng& rng, std::size_t i) {
+        counter_rng s=rng.substream(i);
+        return gate_rng(s());
+    }
+    
 	/*! OCR game.
      */
 	class ocr_game {
@@ -62,12 +89,13 @@ namespace games {
 			typedef std::vector<unsigned char> image_type; //!< "image" type
 			
 			//! Constructor.
-			labeled_image(unsigned char l, unsigned char* f, std::size_t n) : label(l) {
+			labeled_image(unsigned char l, unsigned char* f, std::size_t n) : label(l), index(0) {
 				img.insert(img.end(), f, f+n);
                 std::transform(img.begin(), img.end(), img.begin(), std::bind2nd(std::not_equal_to<unsigned char>(), 0));
 			}
             
 			unsigned char label; //!< label for this image
+            unsigned char index; //!< index of label among all labels, in [0, num_labels())
 			image_type img; //!< image
 		};
 
@@ -76,51 +104,61 @@ namespace games {
             typedef std::vector<std::size_t> index_vector; //!< Type for a list of indices into the image db.
             enum field { P=0, N, TP, FP, TN, FN, LAST }; //!< Indices of positives, negatives, true positives, and false positives in the ROC table.
 
+            typedef boost::array<int,LAST> roc_row; //!< Type for the ROC counters of a single label.
+            typedef std::vector<roc_row> roc_table; //!< Type for the ROC table; one row per label.
+
             //! Constructor.
             template <typename Generator>
-            results(std::size_t n, Generator g) {
-                memset(roc, 0, sizeof(roc));  
+            results(std::size_t n, std::size_t labels, Generator g) {
+                roc_row zero;
+                zero.fill(0);
+                roc.assign(labels, zero);
                 std::generate_n(std::back_inserter(idx), n, g);
             }
+            
+            //! Returns the number of labels.
+            std::size_t num_labels() {
+                return roc.size();
+            }
 
             double mean_tpr() {
                 double x=0.0;
-                for(int i=0; i<10; ++i) {
+                for(std::size_t i=0; i<roc.size(); ++i) {
                     if(roc[i][P] > 0) {
                         x += static_cast<double>(roc[i][TP]) / static_cast<double>(roc[i][P]);
                     }
                 }
-                return x / 10.0;
+                return x / static_cast<double>(roc.size());
             }
 
             double mean_tnr() {
                 double x=0.0;
-                for(int i=0; i<10; ++i) {
+                for(std::size_t i=0; i<roc.size(); ++i) {
                     if(roc[i][N] > 0) {
                         x += static_cast<double>(roc[i][TN]) / static_cast<double>(roc[i][N]);
                     }
                 }
-                return x / 10.0;
+                return x / static_cast<double>(roc.size());
             }
             
             double mean_fpr() {
                 double x=0.0;
-                for(int i=0; i<10; ++i) {
+                for(std::size_t i=0; i<roc.size(); ++i) {
                     if(roc[i][N] > 0) {
                         x += static_cast<double>(roc[i][FP]) / static_cast<double>(roc[i][N]);
                     }
                 }
-                return x / 10.0;
+                return x / static_cast<double>(roc.size());
             }
             
             double mean_fnr() {
                 double x=0.0;
-                for(int i=0; i<10; ++i) {
+                for(std::size_t i=0; i<roc.size(); ++i) {
                     if(roc[i][P] > 0) {
                         x += static_cast<double>(roc[i][FN]) / static_cast<double>(roc[i][P]);
                     }
                 }
-                return x / 10.0;
+                return x / static_cast<double>(roc.size());
             }
             
             double tpr(std::size_t i) {
@@ -153,7 +191,7 @@ namespace games {
 
             double unique_outputs() {
                 double x=0.0;
-                for(int i=0; i<10; ++i) {
+                for(std::size_t i=0; i<roc.size(); ++i) {
                     if(roc[i][TP] || roc[i][FP]) {
                         ++x;
                     }
@@ -172,7 +210,7 @@ namespace games {
             double mean_accuracy() {
                 double acc=0.0;
                 double n=0.0;
-                for(std::size_t i=0; i<10; ++i) {
+                for(std::size_t i=0; i<roc.size(); ++i) {
                     if(roc[i][P] + roc[i][N] > 0) {
                         acc += (static_cast<double>(roc[i][TP] + roc[i][TN])) / (static_cast<double>(roc[i][P] + roc[i][N]));
                         ++n;
@@ -182,19 +220,50 @@ namespace games {
             }
             
             index_vector idx; //!< Indices of the images that were tested
-            int roc[10][LAST]; //!< label x [P, N, TP, FP]
+            roc_table roc; //!< label x [P, N, TP, FP, TN, FN]
         };
 		
 		typedef std::vector<labeled_image> imagedb_type; //!< Type for a list of labeled images.
 		typedef std::vector<int> feature_vector; //!< Feature fector type; input & output from the HMM.
         
 		//! Constructor.
-		ocr_game() : _nin(0), _nout(0) {
+		ocr_game() : _width(0), _nlabels(0), _nin(0), _nout(0), _decode(0), _shared(new shared_state()) {
 		}
         
-        //! Initialize this game.
-		void initialize(const std::string& lname, const std::string& iname, unsigned int width);
+        /*! Initialize this game.
+         
+         The encoding is a '+'-separated list of input features that are
+         precomputed for every image and concatenated to form the network's
+         inputs:
+           pixel - the binarized rows x cols image (the default),
+           pool2 - 2x2 max-pooled image (14x14 for MNIST),
+           pool4 - 4x4 max-pooled image (7x7 for MNIST),
+           proj  - row and column projections; a bit is on if that row (column)
+                   holds at least as many pixels as the mean row (column).
+         E.g., "pool4+proj" yields 7*7+28+28=105 inputs for MNIST.
+         */
+		void initialize(const std::string& lname, const std::string& iname, unsigned int width, const std::string& encoding="pixel");
 
+        //! Return image i.
+        const labeled_image& image(std::size_t i) {
+            return _idb[i];
+        }
+        
+        //! Return the number of images.
+        std::size_t size() {
+            return _idb.size();
+        }
+        
+        //! Return the number of labels.
+        std::size_t num_labels() {
+            return _labels.size();
+        }
+        
+        //! Return the labels, in order of their index.
+        const std::vector<unsigned char>& labels() {
+            return _labels;
+        }
+        
 		//! Return the number of features used for input.
 		unsigned int num_inputs() {
 			return _nin;
@@ -205,52 +274,177 @@ namespace games {
 			return _nout;
 		}
 		
-		//! Play the game.
-		template <typename RNG>
-		results play(fn::hmm::hmm_network& network, std::size_t game_size, std::size_t updates, RNG& rng) {
-            //results r(game_size, rng.uniform_integer_rng(0, _idb.size())); // results from the game
-            results r(game_size, ea::series_generator<std::size_t>(0,1));
+		/*! Play the game.
+         
+         If the hard-example sampler is in use (see resample), the network plays
+         the current sample of images, and game_size is ignored.  Otherwise, it
+         plays the first game_size images.
+         
+         Each image is played with its own substream of rng, so the results for
+         a given network do not depend on the order in which images (or
+         individuals) are evaluated.
+         */
+		results play(fn::hmm::hmm_network& network, std::size_t game_size, std::size_t updates, const counter_rng& rng) {
+            //results r(game_size, _nlabels, rng.uniform_integer_rng(0, _idb.size())); // results from the game
+            boost::shared_ptr<const results::index_vector> games=current_games();
+            results r(games ? 0 : game_size, _nlabels, ea::series_generator<std::size_t>(0,1));
+            if(games) {
+                r.idx.assign(games->begin(), games->end());
+            }
+            play_images(network, r, updates, rng, games.get() != 0);
+            __sync_fetch_and_add(&_shared->plays, 1);
+            return r;
+        }
+        
+        /*! Play a probe game of n images, evenly spaced through the image 
+         database.  The probe set is fixed, and isn't tallied by the sampler.
+         */
+        results probe(fn::hmm::hmm_network& network, std::size_t n, std::size_t updates, const counter_rng& rng) {
+            n = std::min(n, _idb.size());
+            results r(n, _nlabels, ea::series_generator<std::size_t>(0, _idb.size()/n));
+            play_images(network, r, updates, rng, false);
+            return r;
+        }
+        
+        /*! Play the game for a batch of networks, image-major.
+         
+         Produces the same results as calling play() on each network in turn
+         (network i is played with rngs[i]), but tiles the networks x images 
+         grid: a block of tile_images images is encoded once and kept hot in 
+         cache while each block of tile_networks networks plays all of them.
+         Each network still sees the images in the same order, so its internal
+         state evolves exactly as it would in play().
+         
+         ROC counts are accumulated in a structure-of-arrays, keyed by dense
+         label index: positives and negatives depend only on the images and are
+         counted once per label, and true and false positives are kept per label
+         in contiguous runs over the networks.
+         */
+        void play_tiled(std::vector<fn::hmm::hmm_network*>& networks, const std::vector<counter_rng>& rngs,
+                        std::size_t game_size, std::size_t updates, std::size_t tile_networks, std::size_t tile_images,
+                        std::vector<results>& r);
+        
+        /*! Type for a function that decodes the outputs of the HMM for a single 
+         image, whose label has the given index, and tallies them into a ROC
+         table.  Returns the number of labels that were misclassified.
+         */
+        typedef int (*decoder_type)(const int* outputs, unsigned int index, results::roc_table& roc);
+        
+        //! Decode outputs for an arbitrary label width and number of labels.
+        int decode(const int* outputs, unsigned int index, results::roc_table& roc);
+        
+        /*! Draw a new sample of n images for subsequent games, biased towards 
+         images that discriminate between individuals.
+         
+         The first call turns the hard-example sampler on.  From then on, every 
+         play() tallies (lock-free) how often each image was misclassified, and 
+         each image i is weighted by:
+           w_i = floor/N + (1-floor) * d_i / sum(d),  d_i = p_i * (1-p_i),
+         where p_i is the (smoothed) fraction of plays that misclassified it.
+         Images that everyone gets right, or everyone gets wrong, carry little
+         selection signal; those near p=0.5 carry the most.  The floor keeps 
+         every image in play.  Tallies are halved on each call, so that the 
+         sample tracks the population as it improves.
+         */
+        void resample(std::size_t n, double floor, counter_rng rng);
+        
+        //! Returns the number of networks that have played a full game (probes aren't counted).
+        unsigned long plays() {
+            return __sync_fetch_and_add(&_shared->plays, 0);
+        }
+        
+        //! Returns the current sample of images, or null if we're not sampling.
+        boost::shared_ptr<const results::index_vector> current_games() {
+            boost::mutex::scoped_lock lock(_shared->mutex);
+            return _shared->games;
+        }
+        
+        /*! Save the hard-example sampler's state, its tallies and current
+         sample, so that a restarted run continues with them.
+         */
+        template <class Archive>
+        void save_sampler(Archive& ar) {
+            boost::shared_ptr<const results::index_vector> g=current_games();
+            bool sampling=(g != 0);
+            results::index_vector games;
+            if(g) {
+                games.assign(g->begin(), g->end());
+            }
+            ar & boost::serialization::make_nvp("sampling", sampling);
+            ar & boost::serialization::make_nvp("trials", _shared->trials);
+            ar & boost::serialization::make_nvp("errors", _shared->errors);
+            ar & boost::serialization::make_nvp("games", games);
+        }
+        
+        //! Load the hard-example sampler's state; see save_sampler.
+        template <class Archive>
+        void load_sampler(Archive& ar) {
+            bool sampling=false;
+            boost::shared_ptr<results::index_vector> games(new results::index_vector());
+            ar & boost::serialization::make_nvp("sampling", sampling);
+            ar & boost::serialization::make_nvp("trials", _shared->trials);
+            ar & boost::serialization::make_nvp("errors", _shared->errors);
+            ar & boost::serialization::make_nvp("games", *games);
+            
+            boost::mutex::scoped_lock lock(_shared->mutex);
+            if(sampling) {
+                _shared->games = games;
+            } else {
+                _shared->games.reset();
+            }
+        }
+        
+	protected:
+        /*! State shared by all copies of a game, so that replicas of the image
+         database (see ocr_async.h) tally into, and play from, the same sample
+         of the hard-example sampler, and are counted together.
+         */
+        struct shared_state {
+            shared_state() : plays(0) {
+            }
+            
+            unsigned long plays; //!< number of networks that have played a full game
+            std::vector<unsigned int> trials; //!< number of times each image was played
+            std::vector<unsigned int> errors; //!< number of times each image was misclassified
+            boost::shared_ptr<const results::index_vector> games; //!< current sample of images, if any
+            boost::mutex mutex; //!< protects games
+        };
+        
+        //! Play the images in r.idx, tallying per-image errors if tally is true.
+        void play_images(fn::hmm::hmm_network& network, results& r, std::size_t updates, const counter_rng& rng, bool tally) {
+            feature_vector outputs; // outputs from the HMM
+            outputs.reserve(num_outputs());
 
             for(results::index_vector::iterator i=r.idx.begin(); i!=r.idx.end(); ++i) {
                 labeled_image& li=_idb[*i]; // the image we're testing
                 feature_vector inputs(li.img.begin(), li.img.end()); // inputs to the HMM
-                feature_vector outputs; // outputs from the HMM
+                outputs.clear();
                 
-                network.update_n(updates, inputs.begin(), inputs.end(), std::back_inserter(outputs), rng);
+                gate_rng irng=gate_stream(rng, *i); // rng for this image
+                network.update_n(updates, inputs.begin(), inputs.end(), std::back_inserter(outputs), irng);
 
                 // oh, sweet sanity!
                 assert(outputs.size() == num_outputs());
-                assert(num_outputs() == (10*_width));
                 
-                // track roc info (j is label, k is output bit)
-                for(std::size_t j=0,k=0; k<outputs.size(); ++j,k+=_width) {
-                    int on = ea::algorithm::vxor(&outputs[k], &outputs[k+_width]);
-                    
-                    if(li.label == j) {
-                        ++r.roc[j][results::P]; // positives
-                        if(on) {
-                            ++r.roc[j][results::TP]; // true positives
-                        } else {
-                            ++r.roc[j][results::FN]; // false negative
-                        }
-                    } else {
-                        ++r.roc[j][results::N]; // negatives
-                        if(on) {
-                            ++r.roc[j][results::FP]; // false positives
-                        } else {
-                            ++r.roc[j][results::TN]; // true negative
-                        }
-                    }
+                // track roc info:
+                int errors = (_decode != 0) ? _decode(&outputs[0], li.index, r.roc) : decode(&outputs[0], li.index, r.roc);
+                
+                // and per-image error rates, if we're sampling:
+                if(tally) {
+                    __sync_fetch_and_add(&_shared->trials[*i], 1);
+                    __sync_fetch_and_add(&_shared->errors[*i], errors > 0);
                 }
             }
-            return r;
         }
-		
-	protected:
+        
         unsigned int _width; //!< width of output labels
+        unsigned int _nlabels; //!< number of labels
+        std::vector<unsigned char> _labels; //!< labels, in order of their index
 		unsigned int _nin; //!< number of inputs
 		unsigned int _nout; //!< number of outputs
+        decoder_type _decode; //!< specialized decoder for (_width, _nlabels), if any
 		imagedb_type _idb; //!< image database
+        boost::shared_ptr<shared_state> _shared; //!< state shared among copies
 	};
 	
 } // games
@@ -0,0 +1,167 @@
+/* ocr_generalization.h
+ *
+ * This file is part of OCR.
+ *
+ * Copyright 2012 David B. Knoester.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _OCR_GENERALIZATION_H_
+#define _OCR_GENERALIZATION_H_
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <iostream>
+#include <fn/hmm/hmm_network.h>
+#include <ea/exceptions.h>
+#include "ocr_game.h"
+
+/*! Datafile for the generalization of the dominant individual, i.e., its
+ performance on the held-out test images.  Off unless
+ game.ocr.test_image_filename and game.ocr.test_label_filename name a test set;
+ the test set is loaded when the event is created, and must have the same labels
+ as the training images.
+
+ Each recording period, the genome of the individual with the highest order
+ param is copied and handed to a background thread, which plays it against
+ every test image.  The main loop never waits on the evaluation: if the
+ background thread is still busy with an older snapshot, the pending snapshot
+ is simply replaced by the newer one.
+ */
+template <typename EA>
+struct generalization_trajectory : record_statistics_event<EA> {
+    generalization_trajectory(EA& ea) : record_statistics_event<EA>(ea), _pending(false), _stop(false) {
+        if((get<GAME_OCR_TEST_IMAGES>(ea) == "none") || (get<GAME_OCR_TEST_LABELS>(ea) == "none")) {
+            return;
+        }
+        _test.initialize(get<GAME_OCR_TEST_LABELS>(ea), get<GAME_OCR_TEST_IMAGES>(ea), get<GAME_OUTPUT_WIDTH>(ea), get<GAME_OCR_ENCODING>(ea));
+        games::ocr_game& train=ea.fitness_function().game;
+        if((_test.labels() != train.labels()) || (_test.num_outputs() != train.num_outputs()) || (_test.num_inputs() != train.num_inputs())) {
+            throw ea::bad_argument_exception("test images do not have the same labels and geometry as the training images");
+        }
+        
+        _df.reset(new datafile("generalization.dat"));
+        _df->add_field("update")
+        .add_field("train_order", "order param on the training images")
+        .add_field("test_tpr", "mean true positive rate on the test images")
+        .add_field("test_fpr", "mean false positive rate on the test images")
+        .add_field("test_acc", "mean accuracy on the test images")
+        .add_field("test_order", "order param on the test images");
+    }
+
+    virtual ~generalization_trajectory() {
+        {
+            boost::mutex::scoped_lock lock(_mutex);
+            _stop = true;
+        }
+        _cv.notify_all();
+        if(_thread) {
+            _thread->join();
+        }
+    }
+
+    virtual void operator()(EA& ea) {
+        if(!_df) {
+            return;
+        }
+        
+        // individuals screened out by the surrogate only have probe results:
+        typename EA::population_type::iterator best=ea.population().end();
+        for(typename EA::population_type::iterator i=ea.population().begin(); i!=ea.population().end(); ++i) {
+            if(!get<OCR_SCREENED>(ind(i,ea))
+               && ((best == ea.population().end()) || (get<OCR_ORDER>(ind(i,ea)) > get<OCR_ORDER>(ind(best,ea))))) {
+                best = i;
+            }
+        }
+        if(best == ea.population().end()) {
+            return;
+        }
+
+        {
+            boost::mutex::scoped_lock lock(_mutex);
+            _next.update = ea.current_update();
+            _next.train_order = get<OCR_ORDER>(ind(best,ea));
+            _next.repr = ind(best,ea).repr();
+            _pending = true;
+        }
+
+        if(!_thread) {
+            _thread.reset(new boost::thread(boost::bind(&generalization_trajectory::evaluator, this,
+                                                        get<HMM_INPUT_N>(ea), get<HMM_OUTPUT_N>(ea), get<HMM_HIDDEN_N>(ea),
+                                                        get<HMM_UPDATE_N>(ea), get<RNG_SEED>(ea))));
+        }
+        _cv.notify_all();
+    }
+
+    //! A copy of the dominant individual.
+    struct snapshot {
+        unsigned long update; //!< update the snapshot was taken
+        double train_order; //!< order param on the training images
+        typename EA::representation_type repr; //!< genome
+    };
+
+    /*! Background thread; evaluates snapshots until stopped.  Errors are
+     reported, and end the trajectory, rather than the run.
+     */
+    void evaluator(int nin, int nout, int nhidden, std::size_t updates, unsigned int seed) {
+        try {
+            evaluate_snapshots(nin, nout, nhidden, updates, seed);
+        } catch(std::exception& e) {
+            std::cerr << "generalization_trajectory: " << e.what() << std::endl;
+        }
+    }
+    
+    //! Evaluate snapshots against the test images until stopped.
+    void evaluate_snapshots(int nin, int nout, int nhidden, std::size_t updates, unsigned int seed) {
+        for(;;) {
+            snapshot s;
+            {
+                boost::mutex::scoped_lock lock(_mutex);
+                while(!_pending && !_stop) {
+                    _cv.wait(lock);
+                }
+                if(_stop) {
+                    return;
+                }
+                s = _next;
+                _pending = false;
+            }
+
+            fn::hmm::hmm_network network(s.repr, nin, nout, nhidden);
+            games::counter_rng rng(seed, games::genome_id(s.repr.begin(), s.repr.end()), 0);
+            games::ocr_game::results r = _test.play(network, _test.size(), updates, rng);
+
+            double order=(r.mean_tpr()+r.mean_tnr()-r.mean_fpr()-r.mean_fnr()) / (r.mean_tpr()+r.mean_tnr()+r.mean_fpr()+r.mean_fnr());
+            _df->write(s.update)
+            .write(s.train_order)
+            .write(r.mean_tpr())
+            .write(r.mean_fpr())
+            .write(r.mean_accuracy())
+            .write(order)
+            .endl();
+        }
+    }
+
+    boost::scoped_ptr<datafile> _df; //!< only written by the background thread; null if there's no test set
+    games::ocr_game _test; //!< test images; only used by the background thread once loaded
+    snapshot _next; //!< most recent snapshot not yet evaluated
+    bool _pending; //!< true if _next holds a snapshot
+    bool _stop; //!< true when the background thread should exit
+    boost::mutex _mutex; //!< protects _next, _pending, and _stop
+    boost::condition_variable _cv; //!< signaled on a new snapshot or stop
+    boost::scoped_ptr<boost::thread> _thread; //!< background thread
+};
+
+#endif
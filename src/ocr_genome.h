@@ -0,0 +1,502 @@
+/* ocr_genome.h
+ *
+ * This file is part of OCR.
+ *
+ * Copyright 2012 David B. Knoester.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _OCR_GENOME_H_
+#define _OCR_GENOME_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/pool/pool_alloc.hpp>
+#include <boost/type_traits/is_integral.hpp>
+#include <boost/serialization/nvp.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/vector.hpp>
+
+/*! Copy-on-write genome, stored in pooled, fixed-size chunks.
+
+ A genome is a list of views, each a range of sites within a chunk.  Copying a
+ genome copies only the list of views; the chunks are shared with the original
+ until one of them is written to, at which point only the written-to view is
+ copied into a chunk of its own.  Offspring thus share every chunk that
+ mutation didn't touch with their parent.  Insertions and deletions split views
+ rather than moving the sites after them, and adjacent views are merged (by
+ copying) whenever they'd fit in a single chunk, so a genome of n sites never
+ has more than about 2n/ChunkSize views.
+
+ Chunks are allocated from a pool of fixed-size blocks, which is shared by all
+ genomes of the same type and is thread-safe.
+
+ The interface is that of a std::vector, with two differences: non-const
+ access returns a proxy reference, and, as with a vector, iterators are
+ invalidated by insert and erase.  Reads and writes are safe to make
+ concurrently to *different* genomes that share chunks.
+ */
+template <typename T, std::size_t ChunkSize=128>
+class cow_genome {
+public:
+    typedef T value_type; //!< Type of sites.
+    typedef std::size_t size_type; //!< Type for sizes and indices.
+    typedef std::ptrdiff_t difference_type; //!< Type for distances between iterators.
+    typedef T const_reference; //!< Sites are returned by value from a const genome.
+
+    //! Fixed-size block of sites.
+    struct chunk {
+        T data[ChunkSize];
+    };
+
+    typedef boost::shared_ptr<chunk> chunk_ptr; //!< Type of pointer to chunk.
+
+    //! A range of sites within a chunk.
+    struct view {
+        chunk_ptr c; //!< chunk holding the sites
+        size_type off; //!< offset of the first site in the chunk
+        size_type len; //!< number of sites
+        size_type start; //!< index of the first site in the genome
+    };
+
+    typedef std::vector<view> view_list; //!< Type for a list of views.
+
+    //! Reference to a site in a non-const genome; copies its view on write.
+    class reference {
+    public:
+        reference(cow_genome* g, size_type i, size_type h) : _g(g), _i(i), _h(h) {
+        }
+
+        operator T() const {
+            return _g->get(_i, _h);
+        }
+
+        reference& operator=(const T& x) {
+            _g->set(_i, _h, x);
+            return *this;
+        }
+
+        reference& operator=(const reference& that) {
+            return *this = static_cast<T>(that);
+        }
+
+        reference& operator+=(const T& x) {
+            return *this = static_cast<T>(*this) + x;
+        }
+
+        reference& operator-=(const T& x) {
+            return *this = static_cast<T>(*this) - x;
+        }
+
+    protected:
+        cow_genome* _g; //!< genome
+        size_type _i; //!< index of the site
+        size_type _h; //!< index of the view holding the site
+    };
+
+    /*! Random-access iterator over a genome.  The iterator remembers which
+     view it's in, so that sequential access doesn't search for it.
+     */
+    template <typename Genome, typename Reference>
+    class basic_iterator {
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef void pointer;
+        typedef Reference reference;
+
+        basic_iterator() : _g(0), _i(0), _h(0) {
+        }
+
+        basic_iterator(Genome* g, size_type i) : _g(g), _i(i), _h(0) {
+        }
+
+        //! Conversion from iterator to const_iterator.
+        template <typename G, typename R>
+        basic_iterator(const basic_iterator<G,R>& that) : _g(that._g), _i(that._i), _h(that._h) {
+        }
+
+        Reference operator*() const {
+            _h = _g->locate(_i, _h);
+            return cow_genome::deref(_g, _i, _h);
+        }
+
+        Reference operator[](difference_type n) const {
+            return *(*this + n);
+        }
+
+        basic_iterator& operator++() { ++_i; return *this; }
+        basic_iterator operator++(int) { basic_iterator t(*this); ++_i; return t; }
+        basic_iterator& operator--() { --_i; return *this; }
+        basic_iterator operator--(int) { basic_iterator t(*this); --_i; return t; }
+        basic_iterator& operator+=(difference_type n) { _i += n; return *this; }
+        basic_iterator& operator-=(difference_type n) { _i -= n; return *this; }
+        basic_iterator operator+(difference_type n) const { basic_iterator t(*this); t._i += n; return t; }
+        basic_iterator operator-(difference_type n) const { basic_iterator t(*this); t._i -= n; return t; }
+        friend basic_iterator operator+(difference_type n, const basic_iterator& i) { return i + n; }
+
+        template <typename G, typename R>
+        difference_type operator-(const basic_iterator<G,R>& that) const {
+            return static_cast<difference_type>(_i) - static_cast<difference_type>(that._i);
+        }
+
+        template <typename G, typename R> bool operator==(const basic_iterator<G,R>& that) const { return _i == that._i; }
+        template <typename G, typename R> bool operator!=(const basic_iterator<G,R>& that) const { return _i != that._i; }
+        template <typename G, typename R> bool operator<(const basic_iterator<G,R>& that) const { return _i < that._i; }
+        template <typename G, typename R> bool operator>(const basic_iterator<G,R>& that) const { return _i > that._i; }
+        template <typename G, typename R> bool operator<=(const basic_iterator<G,R>& that) const { return _i <= that._i; }
+        template <typename G, typename R> bool operator>=(const basic_iterator<G,R>& that) const { return _i >= that._i; }
+
+        //! Returns the index of the site this iterator points to.
+        size_type index() const {
+            return _i;
+        }
+
+        Genome* _g; //!< genome
+        size_type _i; //!< index of the site
+        mutable size_type _h; //!< index of the view holding the site, if known
+    };
+
+    typedef basic_iterator<cow_genome, reference> iterator; //!< Iterator type.
+    typedef basic_iterator<const cow_genome, T> const_iterator; //!< Const iterator type.
+
+    //! Constructor.
+    cow_genome() : _size(0) {
+    }
+
+    //! Constructor; n copies of x.
+    explicit cow_genome(size_type n, const T& x=T()) : _size(0) {
+        insert(end(), n, x);
+    }
+
+    //! Constructor; copies [f,l).
+    template <typename InputIterator>
+    cow_genome(InputIterator f, InputIterator l) : _size(0) {
+        insert_dispatch(0, f, l, typename boost::is_integral<InputIterator>::type());
+    }
+
+    size_type size() const { return _size; }
+    bool empty() const { return _size == 0; }
+    size_type max_size() const { return static_cast<size_type>(-1); }
+    void reserve(size_type) { }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, _size); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, _size); }
+
+    reference operator[](size_type i) { return reference(this, i, locate(i, 0)); }
+    T operator[](size_type i) const { return get(i, locate(i, 0)); }
+    reference front() { return (*this)[0]; }
+    T front() const { return (*this)[0]; }
+    reference back() { return (*this)[_size-1]; }
+    T back() const { return (*this)[_size-1]; }
+
+    //! Append x.
+    void push_back(const T& x) {
+        if(!_views.empty()) {
+            view& v=_views.back();
+            if(v.c.unique() && ((v.off + v.len) < ChunkSize)) {
+                v.c->data[v.off + v.len] = x;
+                ++v.len;
+                ++_size;
+                return;
+            }
+        }
+        insert(end(), 1, x);
+    }
+
+    //! Remove the last site.
+    void pop_back() {
+        erase(end()-1);
+    }
+
+    //! Insert x before pos.
+    iterator insert(iterator pos, const T& x) {
+        size_type i=pos.index();
+        insert(pos, 1, x);
+        return begin() + i;
+    }
+
+    //! Insert n copies of x before pos.
+    void insert(iterator pos, size_type n, const T& x) {
+        std::vector<T> sites(n, x);
+        insert_sites(pos.index(), sites);
+    }
+
+    //! Insert [f,l) before pos; [f,l) may be part of this genome.
+    template <typename InputIterator>
+    void insert(iterator pos, InputIterator f, InputIterator l) {
+        insert_dispatch(pos.index(), f, l, typename boost::is_integral<InputIterator>::type());
+    }
+
+    //! Erase the site at pos.
+    iterator erase(iterator pos) {
+        return erase(pos, pos+1);
+    }
+
+    //! Erase [f,l).
+    iterator erase(iterator f, iterator l) {
+        size_type i=f.index();
+        if(f == l) {
+            return begin() + i;
+        }
+        size_type a=split(i);
+        size_type b=split(l.index());
+        _views.erase(_views.begin()+a, _views.begin()+b);
+        _size -= (l.index() - i);
+        renumber(a);
+        coalesce(a, a);
+        return begin() + i;
+    }
+
+    //! Replace the contents of this genome with [f,l).
+    template <typename InputIterator>
+    void assign(InputIterator f, InputIterator l) {
+        cow_genome g(f, l);
+        swap(g);
+    }
+
+    //! Resize this genome to n sites, appending copies of x if it grows.
+    void resize(size_type n, const T& x=T()) {
+        if(n < _size) {
+            erase(begin()+n, end());
+        } else if(n > _size) {
+            insert(end(), n-_size, x);
+        }
+    }
+
+    //! Remove all sites.
+    void clear() {
+        _views.clear();
+        _size = 0;
+    }
+
+    //! Swap contents with that genome.
+    void swap(cow_genome& that) {
+        _views.swap(that._views);
+        std::swap(_size, that._size);
+    }
+
+    //! Returns the number of views.
+    size_type num_views() const {
+        return _views.size();
+    }
+
+    /*! Returns a pointer to the sites of view h, and sets n to their number.
+     Views are the unit of sharing between genomes, and so are the natural unit
+     for storing genomes incrementally (see ocr_checkpoint.h).
+     */
+    const T* view_sites(size_type h, size_type& n) const {
+        const view& v=_views[h];
+        n = v.len;
+        return v.c->data + v.off;
+    }
+
+    //! Returns the site at index i, which is in view h.
+    T get(size_type i, size_type h) const {
+        const view& v=_views[h];
+        return v.c->data[v.off + (i - v.start)];
+    }
+
+    //! Set the site at index i, which is in view h, to x.
+    void set(size_type i, size_type h, const T& x) {
+        view& v=_views[h];
+        if(!v.c.unique()) {
+            detach(v);
+        }
+        v.c->data[v.off + (i - v.start)] = x;
+    }
+
+    //! Returns the index of the view holding site i; h is a hint.
+    size_type locate(size_type i, size_type h) const {
+        if(contains(h, i)) {
+            return h;
+        }
+        if(contains(h+1, i)) {
+            return h+1;
+        }
+        std::size_t lo=0, hi=_views.size();
+        while((hi - lo) > 1) {
+            std::size_t mid=(lo + hi) / 2;
+            if(_views[mid].start <= i) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    static reference deref(cow_genome* g, size_type i, size_type h) {
+        return reference(g, i, h);
+    }
+
+    static T deref(const cow_genome* g, size_type i, size_type h) {
+        return g->get(i, h);
+    }
+
+    bool operator==(const cow_genome& that) const {
+        return (_size == that._size) && std::equal(begin(), end(), that.begin());
+    }
+
+    bool operator!=(const cow_genome& that) const {
+        return !(*this == that);
+    }
+
+    bool operator<(const cow_genome& that) const {
+        return std::lexicographical_compare(begin(), end(), that.begin(), that.end());
+    }
+
+protected:
+    friend class boost::serialization::access;
+
+    /*! Save this genome in the same layout as circular_genome, which is
+     serialized as its std::vector<T> base object; checkpoints written with
+     either representation can be read with the other.
+     */
+    template <class Archive>
+    void save(Archive& ar, const unsigned int version) const {
+        std::vector<T> base_type(begin(), end());
+        ar & BOOST_SERIALIZATION_NVP(base_type);
+    }
+
+    //! Load this genome; see save().
+    template <class Archive>
+    void load(Archive& ar, const unsigned int version) {
+        std::vector<T> base_type;
+        ar & BOOST_SERIALIZATION_NVP(base_type);
+        assign(base_type.begin(), base_type.end());
+    }
+
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
+
+    //! Allocate a chunk from the pool.
+    static chunk_ptr allocate() {
+        return boost::allocate_shared_noinit<chunk>(boost::fast_pool_allocator<chunk>());
+    }
+
+    //! Returns true if view h exists and holds site i.
+    bool contains(size_type h, size_type i) const {
+        return (h < _views.size()) && (_views[h].start <= i) && (i < (_views[h].start + _views[h].len));
+    }
+
+    //! Give v its own copy of its sites.
+    void detach(view& v) {
+        chunk_ptr c=allocate();
+        std::copy(v.c->data + v.off, v.c->data + v.off + v.len, c->data);
+        v.c = c;
+        v.off = 0;
+    }
+
+    /*! Ensure that a view starts at site i, and return its index (the number
+     of views, if i is the end of the genome).
+     */
+    size_type split(size_type i) {
+        if(i >= _size) {
+            return _views.size();
+        }
+        size_type h=locate(i, 0);
+        if(_views[h].start == i) {
+            return h;
+        }
+        view right=_views[h];
+        size_type n=i - right.start;
+        _views[h].len = n;
+        right.off += n;
+        right.len -= n;
+        right.start = i;
+        _views.insert(_views.begin()+h+1, right);
+        return h+1;
+    }
+
+    //! Insert sites before site i.
+    void insert_sites(size_type i, const std::vector<T>& sites) {
+        if(sites.empty()) {
+            return;
+        }
+        size_type h=split(i);
+        view_list added;
+        for(size_type k=0; k<sites.size(); k+=ChunkSize) {
+            view v;
+            v.c = allocate();
+            v.off = 0;
+            v.len = std::min(ChunkSize, sites.size()-k);
+            std::copy(sites.begin()+k, sites.begin()+k+v.len, v.c->data);
+            added.push_back(v);
+        }
+        _views.insert(_views.begin()+h, added.begin(), added.end());
+        _size += sites.size();
+        renumber(h);
+        coalesce(h, h+added.size());
+    }
+
+    template <typename Integer>
+    void insert_dispatch(size_type i, Integer n, Integer x, boost::true_type) {
+        std::vector<T> sites(static_cast<size_type>(n), static_cast<T>(x));
+        insert_sites(i, sites);
+    }
+
+    template <typename InputIterator>
+    void insert_dispatch(size_type i, InputIterator f, InputIterator l, boost::false_type) {
+        std::vector<T> sites; // copied first, as [f,l) may be part of this genome
+        for( ; f!=l; ++f) {
+            sites.push_back(*f);
+        }
+        insert_sites(i, sites);
+    }
+
+    //! Recalculate the start of views h onward.
+    void renumber(size_type h) {
+        size_type start=(h == 0) ? 0 : (_views[h-1].start + _views[h-1].len);
+        for( ; h<_views.size(); ++h) {
+            _views[h].start = start;
+            start += _views[h].len;
+        }
+    }
+
+    /*! Merge adjacent views in [first-1, last+1] whose sites fit in a single
+     chunk.  Views elsewhere already satisfy this, so this keeps the number of
+     views bounded.
+     */
+    void coalesce(size_type first, size_type last) {
+        size_type i=std::max<size_type>(first, 1);
+        last = std::min(last+1, _views.size());
+        while(i < last) {
+            view& a=_views[i-1];
+            view& b=_views[i];
+            if((a.len + b.len) <= ChunkSize) {
+                if(!a.c.unique() || ((a.off + a.len + b.len) > ChunkSize)) {
+                    detach(a);
+                }
+                std::copy(b.c->data + b.off, b.c->data + b.off + b.len, a.c->data + a.off + a.len);
+                a.len += b.len;
+                _views.erase(_views.begin()+i);
+                --last;
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    view_list _views; //!< views making up this genome, in order
+    size_type _size; //!< number of sites
+};
+
+#endif
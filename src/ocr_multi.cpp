@@ -20,9 +20,11 @@
 #include <assert.h>
 #include <cmath>
 #include <algorithm>
+#include <sstream>
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
 #include <ea/evolutionary_algorithm.h>
 #include <ea/generational_models/nsga2.h>
-#include <ea/representations/circular_genome.h>
 #include <ea/fitness_function.h>
 #include <ea/cmdline_interface.h>
 #include <ea/datafiles/generation_fitness.h>
@@ -31,7 +33,12 @@
 using namespace ea;
 
 #include "ocr_game.h"
+#include "ocr_genome.h"
 #include "ocr_statistics.h"
+#include "ocr_generalization.h"
+#include "ocr_checkpoint.h"
+#include "ocr_sampler.h"
+#include "ocr_telemetry.h"
 
 
 /*! Fitness function for the OCR problem.
@@ -47,13 +54,16 @@ struct ocr_fitness : fitness_function<multivalued_fitness<double> > {
 		fn::hmm::options::NODE_OUTPUT_FLOOR = get<HMM_OUTPUT_FLOOR>(ea);
 		fn::hmm::options::NODE_OUTPUT_LIMIT = get<HMM_OUTPUT_LIMIT>(ea);        
         
-        game.initialize(get<GAME_OCR_LABELS>(ea), get<GAME_OCR_IMAGES>(ea), get<GAME_OUTPUT_WIDTH>(ea));
+        game.initialize(get<GAME_OCR_LABELS>(ea), get<GAME_OCR_IMAGES>(ea), get<GAME_OUTPUT_WIDTH>(ea), get<GAME_OCR_ENCODING>(ea));
         check_argument(game.num_inputs()==get<HMM_INPUT_N>(ea), "game and HMM input numbers differ");
         check_argument(game.num_outputs()==get<HMM_OUTPUT_N>(ea), "game and HMM output numbers differ");
+        
+        if(get<GAME_OCR_SAMPLER>(ea) == "hard") {
+            game.resample(get<GAME_SIZE>(ea), get<GAME_OCR_SAMPLER_FLOOR>(ea), games::counter_rng(get<RNG_SEED>(ea), 0, 0));
+        }
     }
 
-    template <typename RNG>
-    games::ocr_game::results game_results(fn::hmm::hmm_network& network, std::size_t game_size, std::size_t updates, RNG& rng) {
+    games::ocr_game::results game_results(fn::hmm::hmm_network& network, std::size_t game_size, std::size_t updates, const games::counter_rng& rng) {
         return game.play(network, game_size, updates, rng);
     }
     
@@ -65,11 +75,10 @@ struct ocr_fitness : fitness_function<multivalued_fitness<double> > {
 	value_type operator()(Individual& ind, EA& ea) {
 		fn::hmm::hmm_network network(ind.repr(), get<HMM_INPUT_N>(ea), get<HMM_OUTPUT_N>(ea), get<HMM_HIDDEN_N>(ea));
         
-        next<FF_RNG_SEED>(ea);
-        typename EA::rng_type rng(get<FF_RNG_SEED>(ea)+1); // +1 to avoid clock        
+        // per-individual rng stream; independent of evaluation order:
+        games::counter_rng rng(get<RNG_SEED>(ea), games::genome_id(ind.repr().begin(), ind.repr().end()), static_cast<unsigned int>(ind.generation()));
         games::ocr_game::results r = game_results(network, get<GAME_SIZE>(ea), get<HMM_UPDATE_N>(ea), rng);
         
-        put<FF_RNG_SEED>(get<FF_RNG_SEED>(ea), ind);
         put<OCR_TPR>(r.mean_tpr(), ind);
         put<OCR_TNR>(r.mean_tnr(), ind);
         put<OCR_FPR>(r.mean_fpr(), ind);
@@ -78,9 +87,10 @@ struct ocr_fitness : fitness_function<multivalued_fitness<double> > {
         put<OCR_ACC>(r.mean_accuracy(), ind);
         put<OCR_ORDER>((r.mean_tpr()+r.mean_tnr()-r.mean_fpr()-r.mean_fnr()) / (r.mean_tpr()+r.mean_tnr()+r.mean_fpr()+r.mean_fnr()), ind);
         put<OCR_IMAGES>(algorithm::vcat(r.idx.begin(), r.idx.end()), ind);        
+        put<OCR_SCREENED>(0, ind);
         
         value_type f;
-        for(std::size_t i=0; i<10; ++i) {
+        for(std::size_t i=0; i<r.num_labels(); ++i) {
             f.push_back(r.tpr(i));
             f.push_back(r.tnr(i));
             f.push_back(r.accuracy(i));
@@ -91,9 +101,35 @@ struct ocr_fitness : fitness_function<multivalued_fitness<double> > {
 };
 
 
+//! Rescore the population on the current sample.
+template <typename EA>
+void rescore_population(ocr_fitness& ff, EA& ea) {
+    for(typename EA::population_type::iterator i=ea.population().begin(); i!=ea.population().end(); ++i) {
+        (*i)->fitness() = ff(**i, ea);
+    }
+}
+
+//! Save the hard-example sampler's state in binary checkpoints.
+void bcp_save_state(ocr_fitness& ff, std::string& s) {
+    std::ostringstream out;
+    {
+        boost::archive::text_oarchive oa(out);
+        ff.game.save_sampler(oa);
+    }
+    s = out.str();
+}
+
+//! Restore the hard-example sampler's state from a binary checkpoint.
+void bcp_load_state(ocr_fitness& ff, const std::string& s) {
+    std::istringstream in(s);
+    boost::archive::text_iarchive ia(in);
+    ff.game.load_sampler(ia);
+}
+
+
 //! Evolutionary algorithm definition.
 typedef evolutionary_algorithm<
-circular_genome<unsigned int>,
+cow_genome<unsigned int>,
 hmm_mutation,
 ocr_fitness,
 recombination::asexual,
@@ -124,6 +160,11 @@ public:
         add_option<GAME_OCR_LABELS>(this);
         add_option<GAME_OCR_IMAGES>(this);
         add_option<GAME_OUTPUT_WIDTH>(this);
+        add_option<GAME_OCR_ENCODING>(this);
+        add_option<GAME_OCR_SAMPLER>(this);
+        add_option<GAME_OCR_SAMPLER_FLOOR>(this);
+        add_option<GAME_OCR_TEST_LABELS>(this);
+        add_option<GAME_OCR_TEST_IMAGES>(this);
         
         // ea options
         add_option<REPRESENTATION_SIZE>(this);
@@ -139,8 +180,13 @@ public:
         add_option<RUN_UPDATES>(this);
         add_option<RUN_EPOCHS>(this);
         add_option<CHECKPOINT_PREFIX>(this);
+        add_option<BINARY_CHECKPOINT_PERIOD>(this);
+        add_option<BINARY_CHECKPOINT_KEYFRAME>(this);
+        add_option<BINARY_CHECKPOINT_COMPRESS>(this);
+        add_option<BINARY_CHECKPOINT_UPDATE_OFFSET>(this);
         add_option<RNG_SEED>(this);
         add_option<RECORDING_PERIOD>(this);
+        add_option<TELEMETRY_SOCKET>(this);
         
         // analysis options
         add_option<ANALYSIS_INPUT>(this);
@@ -153,11 +199,16 @@ public:
 //        add_tool<hmm_reduced_graph>(this);
 //        add_tool<hmm_detailed_graph>(this);
 //        add_tool<hmm_causal_graph>(this);
+        add_tool<binary_restart>(this);
     }
     
     virtual void gather_events(EA& ea) {
 //        add_event<datafiles::generation_fitness>(this, ea);
         add_event<mean_roc_trajectory>(this, ea);
+        add_event<generalization_trajectory>(this, ea);
+        add_event<hard_example_sampler>(this, ea);
+        add_event<binary_checkpoint>(this, ea);
+        add_event<telemetry>(this, ea);
     };
 };
 LIBEA_CMDLINE_INSTANCE(ea_type, ocr);
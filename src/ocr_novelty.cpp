@@ -20,8 +20,12 @@
 #include <assert.h>
 #include <cmath>
 #include <algorithm>
+#include <sstream>
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
+#include <ea/evolutionary_algorithm.h>
+#include <ea/generational_models/synchronous.h>
 #include <ea/novelty_search.h>
-#include <ea/representations/circular_genome.h>
 #include <ea/fitness_function.h>
 #include <ea/cmdline_interface.h>
 #include <ea/datafiles/generation_fitness.h>
@@ -30,11 +34,29 @@
 using namespace ea;
 
 #include "ocr_game.h"
+#include "ocr_genome.h"
 #include "ocr_statistics.h"
+#include "ocr_generalization.h"
+#include "ocr_checkpoint.h"
+#include "ocr_sampler.h"
+#include "ocr_novelty_archive.h"
 
-//! Fitness function for the OCR problem.
+LIBEA_MD_DECL(OCR_NOVELTY, "individual.ocr.novelty", double);
+LIBEA_MD_DECL(OCR_OBJECTIVE, "individual.ocr.objective", double);
+
+/*! Fitness function for the OCR problem.
+ 
+ Fitness is novelty: the mean distance from an individual's location in 
+ phenotype space to its nearest neighbors in the population and archive.  As
+ this changes with the population, it is recomputed for every individual once
+ per generation (see renovate); when first evaluated, an individual is only
+ compared to the archive.  Individuals more novel than the threshold are added
+ to the archive.  The archive holds only the phenotype points, not the
+ individuals.
+ */
 struct ocr_fitness : fitness_function<unary_fitness<double>, constantS, absoluteS, stochasticS> {
     games::ocr_game game;
+    novelty_archive archive;
     
     template <typename EA>
     void initialize(EA& ea) {
@@ -43,23 +65,68 @@ struct ocr_fitness : fitness_function<unary_fitness<double>, constantS, absolute
 		fn::hmm::options::NODE_OUTPUT_FLOOR = get<HMM_OUTPUT_FLOOR>(ea);
 		fn::hmm::options::NODE_OUTPUT_LIMIT = get<HMM_OUTPUT_LIMIT>(ea);        
         
-        game.initialize(get<GAME_OCR_LABELS>(ea), get<GAME_OCR_IMAGES>(ea), get<GAME_OUTPUT_WIDTH>(ea));
+        game.initialize(get<GAME_OCR_LABELS>(ea), get<GAME_OCR_IMAGES>(ea), get<GAME_OUTPUT_WIDTH>(ea), get<GAME_OCR_ENCODING>(ea));
         check_argument(game.num_inputs()==get<HMM_INPUT_N>(ea), "game and HMM input numbers differ");
         check_argument(game.num_outputs()==get<HMM_OUTPUT_N>(ea), "game and HMM output numbers differ");
+        
+        if(get<GAME_OCR_SAMPLER>(ea) == "hard") {
+            game.resample(get<GAME_SIZE>(ea), get<GAME_OCR_SAMPLER_FLOOR>(ea), games::counter_rng(get<RNG_SEED>(ea), 0, 0));
+        }
+        
+        archive.initialize(get<NOVELTY_ARCHIVE_CAPACITY>(ea), get<NOVELTY_ARCHIVE_POLICY>(ea), get<RNG_SEED>(ea));
+    }
+    
+    //! Returns the location of an individual in phenotype space (i.e., its novelty point).
+    template <typename Individual>
+    static std::vector<float> point(Individual& ind) {
+        std::vector<float> p;
+        p.push_back(static_cast<float>(get<OCR_TPR>(ind)));
+        p.push_back(static_cast<float>(get<OCR_TNR>(ind)));
+        return p;
+    }
+    
+    /*! Recompute the novelty of every individual in the population, against
+     the rest of the population and the archive.
+     */
+    template <typename Population, typename EA>
+    void renovate(Population& population, EA& ea) {
+        novelty_archive::point_set points;
+        for(typename Population::iterator i=population.begin(); i!=population.end(); ++i) {
+            std::vector<float> p=point(**i);
+            points.resize(p.size());
+            for(std::size_t d=0; d<p.size(); ++d) {
+                points[d].push_back(p[d]);
+            }
+        }
+        
+        for(std::size_t i=0; i<population.size(); ++i) {
+            double novelty = archive.novelty(point(*population[i]), get<NOVELTY_NEIGHBORHOOD_SIZE>(ea), points, i);
+            put<OCR_NOVELTY>(novelty, *population[i]);
+            population[i]->fitness() = novelty;
+        }
+    }
+    
+    //! Serialize the archive, so that checkpoints keep it.
+    template <class Archive>
+    void serialize(Archive& ar, const unsigned int version) {
+        ar & boost::serialization::make_nvp("archive", archive);
     }
     
-    template <typename RNG>
-    games::ocr_game::results game_results(fn::hmm::hmm_network& network, std::size_t game_size, std::size_t updates, RNG& rng) {
+    games::ocr_game::results game_results(fn::hmm::hmm_network& network, std::size_t game_size, std::size_t updates, const games::counter_rng& rng) {
         return game.play(network, game_size, updates, rng);
     }
     
-	template <typename Individual, typename RNG, typename EA>
-	double operator()(Individual& ind, RNG& rng, EA& ea) {
+    /*! Play an individual, and record its results and objective; this doesn't
+     touch the archive.
+     */
+    template <typename Individual, typename EA>
+    void play(Individual& ind, EA& ea) {
 		fn::hmm::hmm_network network(ind.repr(), get<HMM_INPUT_N>(ea), get<HMM_OUTPUT_N>(ea), get<HMM_HIDDEN_N>(ea));
         
-        games::ocr_game::results r = game_results(network, get<GAME_SIZE>(ea), get<HMM_UPDATE_N>(ea), rng);
+        // per-individual rng stream:
+        games::counter_rng stream(get<RNG_SEED>(ea), games::genome_id(ind.repr().begin(), ind.repr().end()), static_cast<unsigned int>(ind.generation()));
+        games::ocr_game::results r = game_results(network, get<GAME_SIZE>(ea), get<HMM_UPDATE_N>(ea), stream);
         
-        put<FF_RNG_SEED>(get<FF_RNG_SEED>(ea), ind);
         put<OCR_TPR>(r.mean_tpr(), ind);
         put<OCR_TNR>(r.mean_tnr(), ind);
         put<OCR_FPR>(r.mean_fpr(), ind);
@@ -68,51 +135,108 @@ struct ocr_fitness : fitness_function<unary_fitness<double>, constantS, absolute
         put<OCR_ACC>(r.mean_accuracy(), ind);
         put<OCR_ORDER>((r.mean_tpr()+r.mean_tnr()-r.mean_fpr()-r.mean_fnr()) / (r.mean_tpr()+r.mean_tnr()+r.mean_fpr()+r.mean_fnr()), ind);
         put<OCR_IMAGES>(algorithm::vcat(r.idx.begin(), r.idx.end()), ind);        
+        put<OCR_SCREENED>(0, ind);
         
         typedef std::vector<double> distance_vector;
         distance_vector dv;
-        for(std::size_t i=0; i<10; ++i) {
+        for(std::size_t i=0; i<r.num_labels(); ++i) {
             dv.push_back(r.tpr(i) * r.tnr(i) * (1.0-r.fpr(i)) * (1.0-r.fnr(i)));
         }
+        put<OCR_OBJECTIVE>(1.0 + ea::algorithm::vmag(dv.begin(), dv.end()), ind);
+    }
+    
+	template <typename Individual, typename RNG, typename EA>
+	double operator()(Individual& ind, RNG& rng, EA& ea) {
+        play(ind, ea);
         
-        // create location in phenotype space (i.e., the novelty point)
-        ind.novelty_point().push_back(r.mean_tpr());
-        ind.novelty_point().push_back(r.mean_tnr());
+        std::vector<float> p=point(ind);
+        double novelty = archive.novelty(p, get<NOVELTY_NEIGHBORHOOD_SIZE>(ea));
+        if((archive.size() == 0) || (novelty > get<NOVELTY_THRESHOLD>(ea))) {
+            archive.add(p);
+        }
         
-        return 1.0 + ea::algorithm::vmag(dv.begin(), dv.end());
+        put<OCR_NOVELTY>(novelty, ind);
+        return novelty;
     }
 };
 
-//! Attributes on individuals (store phenotype information for use by ocr_metric here).
+
+/*! Rescore the population on the current images, on restart or when the sample
+ changes.  Individuals are played again, and their novelty recomputed against
+ the population and the archive, but nothing is added to the archive: it was
+ restored from the checkpoint, or already holds these individuals' points.
+ */
 template <typename EA>
-struct ocr_attrs : individual_attributes<EA> {
-    // location in phenotype space
-    // perf on objective
-};
+void rescore_population(ocr_fitness& ff, EA& ea) {
+    for(typename EA::population_type::iterator i=ea.population().begin(); i!=ea.population().end(); ++i) {
+        ff.play(**i, ea);
+    }
+    ff.renovate(ea.population(), ea);
+}
 
-//! Calculates the distance in novelty space between two individuals.
-struct ocr_metric {
 
-    //! Returns the distance in novelty space between two individuals.
-    template <typename Individual, typename EA>
-    double operator()(Individual& a, Individual& b, EA& ea) {
-        // calculate the distance between a and b in phenotype space.
-        return 0.0;
+//! Save the novelty archive and hard-example sampler in binary checkpoints.
+void bcp_save_state(ocr_fitness& ff, std::string& s) {
+    std::ostringstream out;
+    {
+        boost::archive::text_oarchive oa(out);
+        oa << ff.archive;
+        ff.game.save_sampler(oa);
     }
+    s = out.str();
+}
+
+//! Restore the novelty archive and hard-example sampler from a binary checkpoint.
+void bcp_load_state(ocr_fitness& ff, const std::string& s) {
+    std::istringstream in(s);
+    boost::archive::text_iarchive ia(in);
+    ia >> ff.archive;
+    ff.game.load_sampler(ia);
+}
+
+
+/*! Synchronous generational model, with novelty recomputed before selection.
+ 
+ Offspring are bred from parents chosen by tournament, and survivors are chosen
+ by tournament from parents and offspring together.  Between the two, the
+ novelty of every individual is recomputed against the combined population and
+ the archive (see ocr_fitness::renovate), and once more among the survivors.
+ */
+struct novelty_generational_model : public generational_models::synchronous< > {
     
+    //! Apply this generational model to the population.
+    template <typename Population, typename EA>
+    void operator()(Population& population, EA& ea) {
+        std::size_t n = static_cast<std::size_t>(get<REPLACEMENT_RATE_P>(ea) * population.size());
+        Population parents, offspring;
+        select_n<selection::tournament>(population, parents, n, ea);
+        recombine_n(parents, offspring, typename EA::recombination_operator_type(), n, ea);
+        mutate(offspring.begin(), offspring.end(), ea);
+        calculate_fitness(offspring.begin(), offspring.end(), ea);
+        population.insert(population.end(), offspring.begin(), offspring.end());
+        
+        ea.fitness_function().renovate(population, ea);
+        
+        Population survivors;
+        select_n<selection::tournament>(population, survivors, get<POPULATION_SIZE>(ea), ea);
+        std::swap(population, survivors);
+        
+        // and again among the survivors, so that novelty at the end of an
+        // update depends only on the population and the archive (as it does
+        // when a run is restarted from a checkpoint):
+        ea.fitness_function().renovate(population, ea);
+    }
 };
 
 
 //! Evolutionary algorithm definition.
-typedef novelty_search<
-circular_genome<unsigned int>,
+typedef evolutionary_algorithm<
+cow_genome<unsigned int>,
 hmm_mutation,
 ocr_fitness,
-ocr_metric,
 recombination::asexual,
-generational_models::synchronous< >,
-initialization::complete_population<hmm_random_individual>,
-ocr_attrs
+novelty_generational_model,
+initialization::complete_population<hmm_random_individual>
 > ea_type;
 
 
@@ -137,11 +261,17 @@ public:
         add_option<GAME_OCR_LABELS>(this);
         add_option<GAME_OCR_IMAGES>(this);
         add_option<GAME_OUTPUT_WIDTH>(this);
+        add_option<GAME_OCR_ENCODING>(this);
+        add_option<GAME_OCR_SAMPLER>(this);
+        add_option<GAME_OCR_SAMPLER_FLOOR>(this);
+        add_option<GAME_OCR_TEST_LABELS>(this);
+        add_option<GAME_OCR_TEST_IMAGES>(this);
         
         // ea options
         add_option<NOVELTY_THRESHOLD>(this);
         add_option<NOVELTY_NEIGHBORHOOD_SIZE>(this);
-        add_option<NOVELTY_FITTEST_SIZE>(this);
+        add_option<NOVELTY_ARCHIVE_CAPACITY>(this);
+        add_option<NOVELTY_ARCHIVE_POLICY>(this);
         add_option<REPRESENTATION_SIZE>(this);
         add_option<POPULATION_SIZE>(this);
         add_option<REPLACEMENT_RATE_P>(this);
@@ -155,6 +285,10 @@ public:
         add_option<RUN_UPDATES>(this);
         add_option<RUN_EPOCHS>(this);
         add_option<CHECKPOINT_PREFIX>(this);
+        add_option<BINARY_CHECKPOINT_PERIOD>(this);
+        add_option<BINARY_CHECKPOINT_KEYFRAME>(this);
+        add_option<BINARY_CHECKPOINT_COMPRESS>(this);
+        add_option<BINARY_CHECKPOINT_UPDATE_OFFSET>(this);
         add_option<RNG_SEED>(this);
         add_option<RECORDING_PERIOD>(this);
         
@@ -169,11 +303,16 @@ public:
         //        add_tool<hmm_reduced_graph>(this);
         //        add_tool<hmm_detailed_graph>(this);
         //        add_tool<hmm_causal_graph>(this);
+        add_tool<binary_restart>(this);
     }
     
     virtual void gather_events(EA& ea) {
         //        add_event<datafiles::generation_fitness>(this, ea);
         add_event<mean_roc_trajectory>(this, ea);
+        add_event<generalization_trajectory>(this, ea);
+        add_event<hard_example_sampler>(this, ea);
+        add_event<binary_checkpoint>(this, ea);
+        add_event<novelty_archive_trajectory>(this, ea);
     };
 };
 LIBEA_CMDLINE_INSTANCE(ea_type, ocr);
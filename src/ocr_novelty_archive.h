@@ -0,0 +1,327 @@
+/* ocr_novelty_archive.h
+ *
+ * This file is part of OCR.
+ *
+ * Copyright 2012 David B. Knoester.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _OCR_NOVELTY_ARCHIVE_H_
+#define _OCR_NOVELTY_ARCHIVE_H_
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+#include <boost/serialization/nvp.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/vector.hpp>
+#include <ea/meta_data.h>
+#include <ea/exceptions.h>
+#include "ocr_rng.h"
+
+LIBEA_MD_DECL(NOVELTY_ARCHIVE_CAPACITY, "ea.novelty_search.archive.capacity", unsigned int);
+LIBEA_MD_DECL(NOVELTY_ARCHIVE_POLICY, "ea.novelty_search.archive.policy", std::string);
+
+/*! Archive of points in phenotype space for novelty search.
+
+ Only the points are stored, as floats, in a structure-of-arrays (one array per
+ dimension), so that distance computations stream through memory.  If the
+ capacity is non-zero, the archive never grows beyond it; once full, a new
+ point is admitted according to the eviction policy:
+   reservoir - reservoir sampling; the archive is a uniform sample of all
+               points ever offered to it,
+   cluster   - the closest pair of points (including the new one) is merged
+               into their weighted centroid, so that the archive keeps covering
+               the explored space at a coarser resolution.
+ For the cluster policy, each point's nearest neighbor is kept up to date as
+ points are added and merged, so that finding the closest pair takes a single
+ pass over the archive, rather than a comparison of every pair.
+ */
+class novelty_archive {
+public:
+    enum policy_type { RESERVOIR, CLUSTER };
+
+    typedef std::vector<std::vector<float> > point_set; //!< Type for a set of points; [d][i] is dimension d of point i.
+
+    //! Constructor.
+    novelty_archive() : _capacity(0), _policy(RESERVOIR), _offered(0), _seed(0) {
+    }
+
+    //! Initialize this archive.
+    void initialize(std::size_t capacity, const std::string& policy, unsigned int seed) {
+        _capacity = capacity;
+        if(policy == "reservoir") {
+            _policy = RESERVOIR;
+        } else if(policy == "cluster") {
+            _policy = CLUSTER;
+        } else {
+            throw ea::bad_argument_exception("unknown archive policy: " + policy);
+        }
+        _seed = seed;
+    }
+
+    //! Returns the number of points in the archive.
+    std::size_t size() {
+        return _weight.size();
+    }
+
+    //! Returns the approximate number of bytes used by the archive.
+    std::size_t memory_usage() {
+        std::size_t n=_weight.capacity() * sizeof(float) + _nn.capacity() * (sizeof(std::size_t) + sizeof(float));
+        for(std::size_t d=0; d<_dims.size(); ++d) {
+            n += _dims[d].capacity() * sizeof(float);
+        }
+        return n;
+    }
+
+    /*! Returns the novelty of point p, the mean distance to its k nearest
+     neighbors in the archive.
+     */
+    double novelty(const std::vector<float>& p, std::size_t k) {
+        return novelty(p, k, point_set(), 0);
+    }
+
+    /*! Returns the novelty of point p, the mean distance to its k nearest
+     neighbors in the archive and in others, excluding others' point self
+     (i.e., p's own entry, if it's in others).
+     */
+    double novelty(const std::vector<float>& p, std::size_t k, const point_set& others, std::size_t self) {
+        std::size_t m=others.empty() ? 0 : others[0].size();
+        if((size() + m) == 0) {
+            return 0.0; // nothing to compare to
+        }
+        std::vector<float> dist(size()+m, 0.0f);
+        distances(_dims, p, dist.data(), size());
+        if(m > 0) {
+            distances(others, p, dist.data() + size(), m);
+            if(self < m) {
+                dist.erase(dist.begin() + size() + self);
+            }
+        }
+        if(dist.empty() || (k == 0)) {
+            return 0.0;
+        }
+        k = std::min(k, dist.size());
+        std::nth_element(dist.begin(), dist.begin()+(k-1), dist.end());
+        double n=0.0;
+        for(std::size_t i=0; i<k; ++i) {
+            n += std::sqrt(dist[i]);
+        }
+        return n / static_cast<double>(k);
+    }
+
+    //! Add point p to the archive.
+    void add(const std::vector<float>& p) {
+        if(_dims.empty()) {
+            _dims.resize(p.size());
+        }
+        if((_policy == CLUSTER) && (_nn.size() != size())) {
+            rebuild(); // e.g., just loaded
+        }
+        ++_offered;
+
+        if((_capacity == 0) || (size() < _capacity)) {
+            append(p, 1.0f);
+            return;
+        }
+
+        switch(_policy) {
+            case RESERVOIR: {
+                // the draw for the n'th point offered is keyed on n, so that it
+                // doesn't depend on any other state:
+                games::counter_rng rng(_seed, _offered, 0);
+                std::size_t j=static_cast<std::size_t>(rng.uniform_real(0.0, static_cast<double>(_offered)));
+                if(j < _capacity) {
+                    assign(j, p, 1.0f);
+                }
+                break;
+            }
+            case CLUSTER: {
+                std::vector<float> dist(size(), 0.0f);
+                distances(_dims, p, &dist[0], size());
+                std::size_t nn=std::min_element(dist.begin(), dist.end()) - dist.begin();
+                std::size_t i=std::min_element(_nnd.begin(), _nnd.end()) - _nnd.begin();
+                if(dist[nn] <= _nnd[i]) {
+                    // p is closer to an archived point than any two archived
+                    // points are to each other; merge it into that point:
+                    merge(nn, p, 1.0f);
+                    relocated(nn);
+                } else {
+                    // merge the closest pair, and reuse the freed slot for p:
+                    std::size_t j=_nn[i];
+                    merge(i, point(j), _weight[j]);
+                    assign(j, p, 1.0f);
+                    relocated(i);
+                    relocated(j);
+                }
+                break;
+            }
+        }
+    }
+
+protected:
+    friend class boost::serialization::access;
+
+    //! Save this archive.
+    template <class Archive>
+    void save(Archive& ar, const unsigned int version) const {
+        ar & boost::serialization::make_nvp("offered", _offered);
+        ar & boost::serialization::make_nvp("dims", _dims);
+        ar & boost::serialization::make_nvp("weight", _weight);
+    }
+
+    //! Load this archive; nearest neighbors are rebuilt on the next add.
+    template <class Archive>
+    void load(Archive& ar, const unsigned int version) {
+        ar & boost::serialization::make_nvp("offered", _offered);
+        ar & boost::serialization::make_nvp("dims", _dims);
+        ar & boost::serialization::make_nvp("weight", _weight);
+        _nn.clear();
+        _nnd.clear();
+    }
+    BOOST_SERIALIZATION_SPLIT_MEMBER();
+
+    //! Calculate the squared distance from p to each of the first n points in dims.
+    static void distances(const point_set& dims, const std::vector<float>& p, float* dist, std::size_t n) {
+        if(n == 0) {
+            return;
+        }
+        for(std::size_t d=0; d<dims.size(); ++d) {
+            const float* x=&dims[d][0];
+            float pd=p[d];
+            for(std::size_t i=0; i<n; ++i) {
+                float delta=x[i]-pd;
+                dist[i] += delta*delta;
+            }
+        }
+    }
+
+    //! Returns archived point i.
+    std::vector<float> point(std::size_t i) {
+        std::vector<float> p(_dims.size());
+        for(std::size_t d=0; d<_dims.size(); ++d) {
+            p[d] = _dims[d][i];
+        }
+        return p;
+    }
+
+    //! Find the nearest neighbor of point i by scanning the archive.
+    void rescan(std::size_t i) {
+        std::vector<float> dist(size(), 0.0f);
+        distances(_dims, point(i), &dist[0], size());
+        dist[i] = std::numeric_limits<float>::max();
+        _nn[i] = std::min_element(dist.begin(), dist.end()) - dist.begin();
+        _nnd[i] = dist[_nn[i]];
+    }
+
+    //! Find the nearest neighbor of every point.
+    void rebuild() {
+        _nn.assign(size(), 0);
+        _nnd.assign(size(), std::numeric_limits<float>::max());
+        for(std::size_t i=0; i<size(); ++i) {
+            rescan(i);
+        }
+    }
+
+    /*! Update nearest neighbors after point i was added or moved.  Only the
+     points whose nearest neighbor was i and that are now farther from it need
+     a rescan.
+     */
+    void relocated(std::size_t i) {
+        std::vector<float> dist(size(), 0.0f);
+        distances(_dims, point(i), &dist[0], size());
+        dist[i] = std::numeric_limits<float>::max();
+        _nn[i] = std::min_element(dist.begin(), dist.end()) - dist.begin();
+        _nnd[i] = dist[_nn[i]];
+        for(std::size_t k=0; k<size(); ++k) {
+            if(k == i) {
+                continue;
+            }
+            if(dist[k] < _nnd[k]) {
+                _nn[k] = i;
+                _nnd[k] = dist[k];
+            } else if(_nn[k] == i) {
+                rescan(k);
+            }
+        }
+    }
+
+    //! Append point p with weight w.
+    void append(const std::vector<float>& p, float w) {
+        for(std::size_t d=0; d<_dims.size(); ++d) {
+            _dims[d].push_back(p[d]);
+        }
+        _weight.push_back(w);
+        if(_policy == CLUSTER) {
+            _nn.push_back(0);
+            _nnd.push_back(std::numeric_limits<float>::max());
+            relocated(size()-1);
+        }
+    }
+
+    //! Overwrite slot i with point p and weight w.
+    void assign(std::size_t i, const std::vector<float>& p, float w) {
+        for(std::size_t d=0; d<_dims.size(); ++d) {
+            _dims[d][i] = p[d];
+        }
+        _weight[i] = w;
+    }
+
+    //! Merge point p with weight w into slot i.
+    void merge(std::size_t i, const std::vector<float>& p, float w) {
+        float wi=_weight[i];
+        for(std::size_t d=0; d<_dims.size(); ++d) {
+            _dims[d][i] = (wi*_dims[d][i] + w*p[d]) / (wi + w);
+        }
+        _weight[i] = wi + w;
+    }
+
+    std::size_t _capacity; //!< maximum number of points; 0 is unbounded
+    policy_type _policy; //!< eviction policy
+    unsigned long _offered; //!< number of points ever offered to the archive
+    unsigned int _seed; //!< seed for reservoir sampling
+    point_set _dims; //!< _dims[d][i] is dimension d of point i
+    std::vector<float> _weight; //!< number of points merged into each point
+    std::vector<std::size_t> _nn; //!< nearest neighbor of each point (cluster policy only)
+    std::vector<float> _nnd; //!< squared distance to each point's nearest neighbor
+};
+
+
+/*! Datafile for the size and memory usage of the novelty archive.
+ */
+template <typename EA>
+struct novelty_archive_trajectory : record_statistics_event<EA> {
+    novelty_archive_trajectory(EA& ea) : record_statistics_event<EA>(ea), _df("novelty_archive.dat") {
+        _df.add_field("update")
+        .add_field("size", "number of points in the archive")
+        .add_field("bytes", "memory used by the archive");
+    }
+
+    virtual ~novelty_archive_trajectory() {
+    }
+
+    virtual void operator()(EA& ea) {
+        novelty_archive& a=ea.fitness_function().archive;
+        _df.write(ea.current_update())
+        .write(a.size())
+        .write(a.memory_usage())
+        .endl();
+    }
+
+    datafile _df;
+};
+
+#endif
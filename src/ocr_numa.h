@@ -0,0 +1,139 @@
+/* ocr_numa.h
+ *
+ * This file is part of OCR.
+ *
+ * Copyright 2012 David B. Knoester.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _OCR_NUMA_H_
+#define _OCR_NUMA_H_
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace games {
+
+    /*! NUMA topology of this machine: the list of cpus on each node.
+
+     The topology is read from /sys/devices/system/node; if that isn't
+     available (e.g., not Linux), the machine is treated as a single node
+     holding all online cpus.
+     */
+    class numa_topology {
+    public:
+        typedef std::vector<int> cpu_list; //!< Type for a list of cpus.
+
+        //! Constructor; discovers the topology.
+        numa_topology() {
+            for(int n=0; ; ++n) {
+                std::ostringstream path;
+                path << "/sys/devices/system/node/node" << n << "/cpulist";
+                std::ifstream in(path.str().c_str());
+                if(!in.good()) {
+                    break;
+                }
+                std::string line;
+                std::getline(in, line);
+                cpu_list cpus=parse_cpulist(line);
+                if(!cpus.empty()) {
+                    _nodes.push_back(cpus);
+                }
+            }
+
+            if(_nodes.empty()) {
+                cpu_list cpus;
+                long n=sysconf(_SC_NPROCESSORS_ONLN);
+                for(long i=0; i<std::max(n,1L); ++i) {
+                    cpus.push_back(static_cast<int>(i));
+                }
+                _nodes.push_back(cpus);
+            }
+        }
+
+        //! Returns the number of nodes.
+        std::size_t num_nodes() {
+            return _nodes.size();
+        }
+
+        //! Returns the cpus on node n.
+        const cpu_list& cpus(std::size_t n) {
+            return _nodes[n];
+        }
+
+        /*! Returns the node that worker k is placed on.  Workers are dealt
+         round-robin across nodes, so that every node's memory bandwidth is used
+         before any node is doubled up.
+         */
+        std::size_t node_of(std::size_t k) {
+            return k % _nodes.size();
+        }
+
+        //! Returns the cpu that worker k is placed on.
+        int cpu_of(std::size_t k) {
+            const cpu_list& c=_nodes[node_of(k)];
+            return c[(k / _nodes.size()) % c.size()];
+        }
+
+        /*! Parse a Linux cpulist, e.g., "0-7,16-23".
+         */
+        static cpu_list parse_cpulist(const std::string& s) {
+            cpu_list cpus;
+            std::istringstream in(s);
+            std::string range;
+            while(std::getline(in, range, ',')) {
+                if(range.empty() || (range[0] < '0') || (range[0] > '9')) {
+                    continue;
+                }
+                std::size_t dash=range.find('-');
+                int first=std::atoi(range.c_str());
+                int last=(dash == std::string::npos) ? first : std::atoi(range.c_str()+dash+1);
+                for(int i=first; i<=last; ++i) {
+                    cpus.push_back(i);
+                }
+            }
+            return cpus;
+        }
+
+    protected:
+        std::vector<cpu_list> _nodes; //!< cpus on each node
+    };
+
+    /*! Pin the calling thread to cpu.  Returns false if the thread couldn't be
+     pinned (not supported here, or the cpu isn't in our allowed set); the
+     thread is then left where the scheduler put it.
+     */
+    inline bool pin_this_thread(int cpu) {
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+        return false;
+#endif
+    }
+
+} // games
+
+#endif
@@ -0,0 +1,155 @@
+/* ocr_profile.h
+ * 
+ * This file is part of OCR.
+ * 
+ * Copyright 2012 David B. Knoester.
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _OCR_PROFILE_H_
+#define _OCR_PROFILE_H_
+
+#include <cmath>
+#include <map>
+#include <vector>
+#include <fn/hmm/hmm_network.h>
+#include "ocr_game.h"
+
+//! Returns the entropy (in bits) of a histogram.
+template <typename Histogram>
+double histogram_entropy(const Histogram& h) {
+    double n=0.0, e=0.0;
+    for(typename Histogram::const_iterator i=h.begin(); i!=h.end(); ++i) {
+        n += i->second;
+    }
+    for(typename Histogram::const_iterator i=h.begin(); i!=h.end(); ++i) {
+        double p = i->second / n;
+        e -= p * std::log(p) / std::log(2.0);
+    }
+    return e;
+}
+
+//! Returns the bits of state at the given indices, packed into an integer.
+template <typename State, typename Indices>
+unsigned int state_pattern(const State& s, const Indices& idx) {
+    unsigned int x=0;
+    for(std::size_t i=0; i<idx.size(); ++i) {
+        x |= (s[idx[i]] & 0x01) << i;
+    }
+    return x;
+}
+
+/*! Per-gate execution profile of the dominant individual.
+ 
+ Replays the dominant individual over the game images one network update at a
+ time, and after each update records, for every gate, the pattern of bits it
+ read (its inputs in t-1) and the pattern of bits at its outputs (in t).  For
+ each gate, the datafile written to --analysis.output holds:
+   type        - 0 for deterministic, 1 for probabilistic,
+   table       - cost proxy: entries in the gate's table, 2^nin x nout for a
+                 deterministic gate and 2^nin x 2^nout for a probabilistic one,
+   rng_draws   - cost proxy: rng draws the gate made over the replay; one per
+                 update for a probabilistic gate, none for a deterministic one,
+   in_entropy  - entropy of the observed input patterns,
+   out_entropy - entropy of the observed output bits; note that output bits
+                 shared with other gates are attributed to all of them,
+   constant    - 1 if the gate's output is constant over the image set: a 
+                 deterministic gate whose table maps every input pattern it
+                 was seen to read to the same output.
+ Constant gates are candidates for constant-folding in the evaluator.  Every
+ gate is updated once per network update, so the cost of a gate is given by the
+ proxies above, not by timing: a gate's update is too cheap to time on its own,
+ and can't be replayed outside of its network.
+ */
+LIBEA_ANALYSIS_TOOL(hmm_gate_profile) {
+    typedef std::map<unsigned int, double> histogram;
+    
+    typename EA::individual_type& indi = analysis::find_most_fit_individual(ea);
+    fn::hmm::hmm_network network(indi.repr(), get<HMM_INPUT_N>(ea), get<HMM_OUTPUT_N>(ea), get<HMM_HIDDEN_N>(ea));
+    games::ocr_game& game=ea.fitness_function().game;
+    games::counter_rng stream(get<RNG_SEED>(ea), games::genome_id(indi.repr().begin(), indi.repr().end()), static_cast<unsigned int>(indi.generation()));
+    
+    games::ocr_game::results::index_vector idx;
+    boost::shared_ptr<const games::ocr_game::results::index_vector> games=game.current_games();
+    if(games) {
+        idx.assign(games->begin(), games->end());
+    } else {
+        std::generate_n(std::back_inserter(idx), static_cast<std::size_t>(get<GAME_SIZE>(ea)), ea::series_generator<std::size_t>(0,1));
+    }
+    
+    std::size_t ngates=network.num_gates();
+    std::vector<histogram> in(ngates), out(ngates);
+    double updates=0.0;
+    
+    for(std::size_t i=0; i<idx.size(); ++i) {
+        const games::ocr_game::labeled_image& li=game.image(idx[i]);
+        games::ocr_game::feature_vector inputs(li.img.begin(), li.img.end()), outputs;
+        games::gate_rng irng=games::gate_stream(stream, idx[i]);
+        
+        for(int u=0; u<get<HMM_UPDATE_N>(ea); ++u) {
+            outputs.clear();
+            network.update_n(1, inputs.begin(), inputs.end(), std::back_inserter(outputs), irng);
+            updates += 1.0;
+            
+            for(std::size_t g=0; g<ngates; ++g) {
+                fn::hmm::hmm_node& node=network.gate(g);
+                in[g][state_pattern(network.tminus1(), node._in)] += 1.0;
+                out[g][state_pattern(network.t(), node._out)] += 1.0;
+            }
+        }
+    }
+    
+    datafile df(get<ANALYSIS_OUTPUT>(ea));
+    df.add_field("gate")
+    .add_field("type", "0=deterministic, 1=probabilistic")
+    .add_field("nin")
+    .add_field("nout")
+    .add_field("table", "cost proxy: table entries, 2^nin x nout (deterministic) or 2^nin x 2^nout (probabilistic)")
+    .add_field("rng_draws", "cost proxy: rng draws over the replay")
+    .add_field("in_entropy", "entropy of input patterns (bits)")
+    .add_field("out_entropy", "entropy of output patterns (bits)")
+    .add_field("constant", "1 if the gate's output is constant");
+    
+    for(std::size_t g=0; g<ngates; ++g) {
+        fn::hmm::hmm_node& node=network.gate(g);
+        bool probabilistic=(dynamic_cast<fn::hmm::probabilistic_node*>(&node) != 0);
+        double rows=std::ldexp(1.0, static_cast<int>(node._in.size()));
+        double cols=probabilistic ? std::ldexp(1.0, static_cast<int>(node._out.size())) : static_cast<double>(node._out.size());
+        
+        // a deterministic gate's output is constant if its table gives the same
+        // output for every input pattern it read:
+        bool constant=false;
+        fn::hmm::deterministic_node* d=dynamic_cast<fn::hmm::deterministic_node*>(&node);
+        if((d != 0) && !in[g].empty()) {
+            constant = true;
+            unsigned int first=in[g].begin()->first;
+            for(histogram::iterator p=in[g].begin(); p!=in[g].end(); ++p) {
+                constant = constant && (d->_table[p->first] == d->_table[first]);
+            }
+        }
+        
+        df.write(g)
+        .write(probabilistic)
+        .write(node._in.size())
+        .write(node._out.size())
+        .write(rows * cols)
+        .write(probabilistic ? updates : 0.0)
+        .write(histogram_entropy(in[g]))
+        .write(histogram_entropy(out[g]))
+        .write(constant)
+        .endl();
+    }
+}
+
+#endif
@@ -0,0 +1,157 @@
+/* ocr_rng.h
+ *
+ * This file is part of OCR.
+ *
+ * Copyright 2012 David B. Knoester.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _OCR_RNG_H_
+#define _OCR_RNG_H_
+
+#include <boost/cstdint.hpp>
+#include <cstddef>
+
+namespace games {
+
+    /*! Counter-based random number generator (Philox4x32-10).
+
+     Each random number is a pure function of a key and a counter, so a stream
+     is identified by what it is *for* (run seed, individual, generation, image),
+     not by how many numbers were drawn before it.  This makes evaluations
+     reproducible regardless of the order in which they are run, or on which
+     thread.  Streams are cheap to create: the entire state is 40 bytes, and
+     there's no seeding cost.
+
+     The key is (run seed, individual id), and the counter is (block, image,
+     generation, 0); the block is incremented as numbers are drawn.
+
+     Provides the same interface as the libea RNG for the routines that HMM
+     gates use, though gates are given a libea rng seeded from a stream (see
+     games::gate_rng).
+     */
+    class counter_rng {
+    public:
+        typedef boost::uint32_t result_type; //!< Type of random numbers.
+
+        //! Constructor.
+        counter_rng(boost::uint32_t seed, boost::uint64_t id, boost::uint32_t generation) : _used(4) {
+            _key[0] = seed;
+            _key[1] = static_cast<boost::uint32_t>(id ^ (id >> 32));
+            _ctr[0] = 0;
+            _ctr[1] = 0;
+            _ctr[2] = generation;
+            _ctr[3] = 0;
+        }
+
+        //! Returns the stream for image i derived from this one.
+        counter_rng substream(std::size_t i) const {
+            counter_rng r(*this);
+            r._ctr[0] = 0;
+            r._ctr[1] = static_cast<boost::uint32_t>(i);
+            r._used = 4;
+            return r;
+        }
+
+        //! Returns the smallest number that can be generated.
+        result_type min() const { return 0; }
+
+        //! Returns the largest number that can be generated.
+        result_type max() const { return 0xffffffff; }
+
+        //! Returns a random number in [min(), max()].
+        result_type operator()() {
+            if(_used == 4) {
+                generate();
+            }
+            return _out[_used++];
+        }
+
+        //! Returns a random number in [0, n); compatible with std::random_shuffle.
+        std::ptrdiff_t operator()(std::ptrdiff_t n) {
+            return static_cast<std::ptrdiff_t>(uniform_real(0.0, static_cast<double>(n)));
+        }
+
+        //! Returns a random real in [min, max).
+        double uniform_real(double min, double max) {
+            return min + (max - min) * p();
+        }
+
+        //! Returns a random integer in [min, max).
+        template <typename T>
+        T uniform_integer(T min, T max) {
+            return min + static_cast<T>(uniform_real(0.0, static_cast<double>(max - min)));
+        }
+
+        //! Returns a random real in [0, 1).
+        double p() {
+            return static_cast<double>((*this)()) * (1.0 / 4294967296.0);
+        }
+
+        //! Returns true with probability prob.
+        bool p(double prob) {
+            return p() < prob;
+        }
+
+        //! Returns a random bit.
+        bool bit() {
+            return (*this)() & 0x1;
+        }
+
+    protected:
+        //! Generate the next block of four random numbers and advance the counter.
+        void generate() {
+            boost::uint32_t c[4] = { _ctr[0], _ctr[1], _ctr[2], _ctr[3] };
+            boost::uint32_t k[2] = { _key[0], _key[1] };
+            for(int i=0; i<10; ++i) {
+                boost::uint64_t p0 = static_cast<boost::uint64_t>(0xD2511F53) * c[0];
+                boost::uint64_t p1 = static_cast<boost::uint64_t>(0xCD9E8D57) * c[2];
+                boost::uint32_t t[4] = {
+                    static_cast<boost::uint32_t>(p1 >> 32) ^ c[1] ^ k[0],
+                    static_cast<boost::uint32_t>(p1),
+                    static_cast<boost::uint32_t>(p0 >> 32) ^ c[3] ^ k[1],
+                    static_cast<boost::uint32_t>(p0) };
+                c[0] = t[0]; c[1] = t[1]; c[2] = t[2]; c[3] = t[3];
+                k[0] += 0x9E3779B9;
+                k[1] += 0xBB67AE85;
+            }
+            _out[0] = c[0]; _out[1] = c[1]; _out[2] = c[2]; _out[3] = c[3];
+            ++_ctr[0];
+            _used = 0;
+        }
+
+        boost::uint32_t _key[2]; //!< key: (seed, individual id)
+        boost::uint32_t _ctr[4]; //!< counter: (block, image, generation, 0)
+        boost::uint32_t _out[4]; //!< current block of random numbers
+        int _used; //!< number of random numbers used from the current block
+    };
+
+    /*! Returns an identifier for a genome, suitable for keying a counter_rng.
+
+     The id is a hash of the genome's contents (64-bit FNV-1a), so it does not
+     depend on when or where the individual was created.
+     */
+    template <typename ForwardIterator>
+    boost::uint64_t genome_id(ForwardIterator f, ForwardIterator l) {
+        boost::uint64_t h = 14695981039346656037ULL;
+        for( ; f!=l; ++f) {
+            h ^= static_cast<boost::uint64_t>(*f);
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+} // games
+
+#endif
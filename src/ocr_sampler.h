@@ -0,0 +1,53 @@
+/* ocr_sampler.h
+ * 
+ * This file is part of OCR.
+ * 
+ * Copyright 2012 David B. Knoester.
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _OCR_SAMPLER_H_
+#define _OCR_SAMPLER_H_
+
+#include "ocr_game.h"
+#include "ocr_checkpoint.h"
+
+/*! Draws the next update's images with the hard-example sampler, if
+ game.ocr.sampler=hard.  The sample is keyed on the update (counted across
+ restarts), so it is the same regardless of how the update's evaluations were
+ scheduled, or whether the run was restarted.
+
+ Once the sample changes, fitness measured on the old one can't be compared to
+ fitness measured on the new one, so the population is rescored on the new
+ sample (see rescore_population).  This must be added before binary_checkpoint,
+ so that checkpoints hold the sample the population was scored on.
+ */
+template <typename EA>
+struct hard_example_sampler : end_of_update_event<EA> {
+    hard_example_sampler(EA& ea) : end_of_update_event<EA>(ea) {
+    }
+    
+    virtual ~hard_example_sampler() {
+    }
+    
+    virtual void operator()(EA& ea) {
+        if(get<GAME_OCR_SAMPLER>(ea) == "hard") {
+            games::counter_rng rng(get<RNG_SEED>(ea), 0, run_update(ea)+1);
+            ea.fitness_function().game.resample(get<GAME_SIZE>(ea), get<GAME_OCR_SAMPLER_FLOOR>(ea), rng);
+            rescore_population(ea.fitness_function(), ea);
+        }
+    }
+};
+
+#endif
@@ -20,10 +20,12 @@
 #include <assert.h>
 #include <cmath>
 #include <algorithm>
+#include <sstream>
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
 #include <ea/evolutionary_algorithm.h>
 #include <ea/generational_models/synchronous.h>
 #include <ea/generational_models/death_birth_process.h>
-#include <ea/representations/circular_genome.h>
 #include <ea/fitness_function.h>
 #include <ea/cmdline_interface.h>
 #include <ea/datafiles/generation_fitness.h>
@@ -32,12 +34,21 @@
 using namespace ea;
 
 #include "ocr_game.h"
+#include "ocr_genome.h"
 #include "ocr_statistics.h"
+#include "ocr_generalization.h"
+#include "ocr_checkpoint.h"
+#include "ocr_sampler.h"
+#include "ocr_surrogate.h"
+#include "ocr_profile.h"
+#include "ocr_async.h"
+#include "ocr_telemetry.h"
 
 /*! Fitness function for the OCR problem.
  */
 struct ocr_fitness : fitness_function<unary_fitness<double>, constantS, absoluteS, stochasticS> {
     games::ocr_game game;
+    surrogate_model surrogate;
 
     template <typename EA>
     void initialize(EA& ea) {
@@ -46,23 +57,22 @@ struct ocr_fitness : fitness_function<unary_fitness<double>, constantS, absolute
 		fn::hmm::options::NODE_OUTPUT_FLOOR = get<HMM_OUTPUT_FLOOR>(ea);
 		fn::hmm::options::NODE_OUTPUT_LIMIT = get<HMM_OUTPUT_LIMIT>(ea);        
         
-        game.initialize(get<GAME_OCR_LABELS>(ea), get<GAME_OCR_IMAGES>(ea), get<GAME_OUTPUT_WIDTH>(ea));
+        game.initialize(get<GAME_OCR_LABELS>(ea), get<GAME_OCR_IMAGES>(ea), get<GAME_OUTPUT_WIDTH>(ea), get<GAME_OCR_ENCODING>(ea));
         check_argument(game.num_inputs()==get<HMM_INPUT_N>(ea), "game and HMM input numbers differ");
         check_argument(game.num_outputs()==get<HMM_OUTPUT_N>(ea), "game and HMM output numbers differ");
+        check_argument((get<GAME_OCR_SURROGATE_SIZE>(ea) == 0) || (get<BINARY_CHECKPOINT_PERIOD>(ea) == 0), "runs that use the surrogate can't be binary checkpointed");
+        check_argument((get<GAME_OCR_SAMPLER>(ea) != "hard") || (get<ASYNC_THREADS>(ea) == 0) || (get<ASYNC_STALENESS>(ea) == 0), "the hard-example sampler requires async.staleness=0");
+        
+        if(get<GAME_OCR_SAMPLER>(ea) == "hard") {
+            game.resample(get<GAME_SIZE>(ea), get<GAME_OCR_SAMPLER_FLOOR>(ea), games::counter_rng(get<RNG_SEED>(ea), 0, 0));
+        }
     }
 
-    template <typename RNG>
-    games::ocr_game::results game_results(fn::hmm::hmm_network& network, std::size_t game_size, std::size_t updates, RNG& rng) {
-        return game.play(network, game_size, updates, rng);
-    }
-    
-	template <typename Individual, typename RNG, typename EA>
-	double operator()(Individual& ind, RNG& rng, EA& ea) {
-		fn::hmm::hmm_network network(ind.repr(), get<HMM_INPUT_N>(ea), get<HMM_OUTPUT_N>(ea), get<HMM_HIDDEN_N>(ea));
-        
-        games::ocr_game::results r = game_results(network, get<GAME_SIZE>(ea), get<HMM_UPDATE_N>(ea), rng);
-        
-        put<FF_RNG_SEED>(get<FF_RNG_SEED>(ea), ind);
+    /*! Record the results of a game on the individual, and return its fitness.
+     The individual is marked as fully evaluated.
+     */
+    template <typename Individual, typename EA>
+    double record_results(games::ocr_game::results& r, Individual& ind, EA& ea) {
         put<OCR_TPR>(r.mean_tpr(), ind);
         put<OCR_TNR>(r.mean_tnr(), ind);
         put<OCR_FPR>(r.mean_fpr(), ind);
@@ -71,8 +81,53 @@ struct ocr_fitness : fitness_function<unary_fitness<double>, constantS, absolute
         put<OCR_ACC>(r.mean_accuracy(), ind);
         put<OCR_ORDER>((r.mean_tpr()+r.mean_tnr()-r.mean_fpr()-r.mean_fnr()) / (r.mean_tpr()+r.mean_tnr()+r.mean_fpr()+r.mean_fnr()), ind);
         put<OCR_IMAGES>(algorithm::vcat(r.idx.begin(), r.idx.end()), ind);
-
+        put<OCR_SCREENED>(0, ind);
+        
         return 1.0 + get<OCR_ORDER>(ind);
+    }
+    
+    /*! Returns the rng stream for an individual.  Streams are keyed by the run,
+     the genome, and its generation, so that results don't depend on evaluation
+     order.
+     */
+    template <typename Individual, typename EA>
+    games::counter_rng stream(Individual& ind, EA& ea) {
+        return games::counter_rng(get<RNG_SEED>(ea), games::genome_id(ind.repr().begin(), ind.repr().end()), static_cast<unsigned int>(ind.generation()));
+    }
+    
+	template <typename Individual, typename RNG, typename EA>
+	double operator()(Individual& ind, RNG& rng, EA& ea) {
+        return evaluate(ind, game, ea);
+    }
+    
+    /*! Calculate the fitness of an individual by playing it on g, which is
+     either this fitness function's game or a replica of it (see 
+     evaluation_pool).
+     */
+    template <typename Individual, typename EA>
+    double evaluate(Individual& ind, games::ocr_game& g, EA& ea) {
+        games::counter_rng stream=this->stream(ind, ea);
+        
+        // if we're using the surrogate, screen the individual on the probe set
+        // first; those that don't pass keep their probe results, marked as
+        // such, but not their probe fitness, which could outrank fully
+        // evaluated individuals:
+        if(get<GAME_OCR_SURROGATE_SIZE>(ea) > 0) {
+            fn::hmm::hmm_network network(ind.repr(), get<HMM_INPUT_N>(ea), get<HMM_OUTPUT_N>(ea), get<HMM_HIDDEN_N>(ea));
+            games::ocr_game::results p = g.probe(network, get<GAME_OCR_SURROGATE_SIZE>(ea), get<HMM_UPDATE_N>(ea), stream);
+            double predicted = record_results(p, ind, ea);
+            put<OCR_PROBE>(predicted, ind);
+            if(!surrogate.screen(predicted, get<GAME_OCR_SURROGATE_THRESHOLD>(ea))) {
+                put<OCR_SCREENED>(1, ind);
+                return surrogate_model::screened_fitness();
+            }
+        }
+        
+        double f = play(ind, g, ea);
+        if(get<GAME_OCR_SURROGATE_SIZE>(ea) > 0) {
+            surrogate.observe(f);
+        }
+        return f;
         
 //        typedef std::vector<double> distance_vector;
 //        distance_vector dv;
@@ -82,17 +137,108 @@ struct ocr_fitness : fitness_function<unary_fitness<double>, constantS, absolute
 //        
 //        return 1.0 + ea::algorithm::vmag(dv.begin(), dv.end());
     }
+    
+    //! Play an individual on the full game on g, and return its fitness.
+    template <typename Individual, typename EA>
+    double play(Individual& ind, games::ocr_game& g, EA& ea) {
+		fn::hmm::hmm_network network(ind.repr(), get<HMM_INPUT_N>(ea), get<HMM_OUTPUT_N>(ea), get<HMM_HIDDEN_N>(ea));
+        games::ocr_game::results r = g.play(network, get<GAME_SIZE>(ea), get<HMM_UPDATE_N>(ea), stream(ind, ea));
+        return record_results(r, ind, ea);
+    }
+    
+    /*! Calculate the fitness of a batch of individuals, [f,l).  The surrogate
+     screens individuals one at a time, so it falls back to evaluate().
+     */
+    template <typename ForwardIterator, typename EA>
+    void evaluate_batch(ForwardIterator f, ForwardIterator l, games::ocr_game& g, EA& ea) {
+        if(get<GAME_OCR_SURROGATE_SIZE>(ea) > 0) {
+            for( ; f!=l; ++f) {
+                (*f)->fitness() = evaluate(**f, g, ea);
+            }
+            return;
+        }
+        play_batch(f, l, g, ea);
+    }
+    
+    /*! Play a batch of individuals, [f,l), on the full game, image-major on g
+     (see games::ocr_game::play_tiled), and set their fitness.
+     */
+    template <typename ForwardIterator, typename EA>
+    void play_batch(ForwardIterator f, ForwardIterator l, games::ocr_game& g, EA& ea) {
+        std::vector<boost::shared_ptr<fn::hmm::hmm_network> > networks;
+        std::vector<fn::hmm::hmm_network*> nptrs;
+        std::vector<games::counter_rng> streams;
+        for(ForwardIterator i=f; i!=l; ++i) {
+            networks.push_back(boost::shared_ptr<fn::hmm::hmm_network>(new fn::hmm::hmm_network((*i)->repr(), get<HMM_INPUT_N>(ea), get<HMM_OUTPUT_N>(ea), get<HMM_HIDDEN_N>(ea))));
+            nptrs.push_back(networks.back().get());
+            streams.push_back(stream(**i, ea));
+        }
+        
+        std::vector<games::ocr_game::results> r;
+        g.play_tiled(nptrs, streams, get<GAME_SIZE>(ea), get<HMM_UPDATE_N>(ea), get<GAME_OCR_TILE_NETWORKS>(ea), get<GAME_OCR_TILE_IMAGES>(ea), r);
+        for(std::size_t k=0; f!=l; ++f, ++k) {
+            (*f)->fitness() = record_results(r[k], **f, ea);
+        }
+    }
 };
 
+/*! Rescore the population on the current sample, in batches of
+ game.ocr.tile.networks individuals.  Individuals that were screened out by the
+ surrogate stay so, as the probe set doesn't change; the rest are played again
+ without being screened.
+ */
+template <typename EA>
+void rescore_population(ocr_fitness& ff, EA& ea) {
+    typedef typename EA::population_type population_type;
+    population_type full;
+    for(typename population_type::iterator i=ea.population().begin(); i!=ea.population().end(); ++i) {
+        if((get<GAME_OCR_SURROGATE_SIZE>(ea) == 0) || !get<OCR_SCREENED>(**i)) {
+            full.push_back(*i);
+        }
+    }
+    
+    std::size_t n=std::max<std::size_t>(get<GAME_OCR_TILE_NETWORKS>(ea), 1);
+    for(typename population_type::iterator i=full.begin(); i!=full.end(); ) {
+        typename population_type::iterator j=i + std::min<std::size_t>(n, full.end() - i);
+        ff.play_batch(i, j, ff.game, ea);
+        i = j;
+    }
+}
+
+//! Save the hard-example sampler's state in binary checkpoints.
+void bcp_save_state(ocr_fitness& ff, std::string& s) {
+    std::ostringstream out;
+    {
+        boost::archive::text_oarchive oa(out);
+        ff.game.save_sampler(oa);
+    }
+    s = out.str();
+}
+
+//! Restore the hard-example sampler's state from a binary checkpoint.
+void bcp_load_state(ocr_fitness& ff, const std::string& s) {
+    std::istringstream in(s);
+    boost::archive::text_iarchive ia(in);
+    ff.game.load_sampler(ia);
+}
+
+/*! Add the surrogate's counters to a telemetry snapshot.
+ */
+inline void telemetry_extras(ocr_fitness& ff, telemetry_snapshot& s) {
+    surrogate_model::stats t=ff.surrogate.totals();
+    s.candidates = t.candidates;
+    s.screened = t.screened;
+}
+
 
 
 //! Evolutionary algorithm definition.
 typedef evolutionary_algorithm<
-circular_genome<unsigned int>,
+cow_genome<unsigned int>,
 hmm_mutation,
 ocr_fitness,
 recombination::asexual,
-generational_models::death_birth_process,
+async_death_birth_process,
 initialization::complete_population<hmm_random_individual>
 > ea_type;
 
@@ -118,11 +264,23 @@ public:
         add_option<GAME_OCR_LABELS>(this);
         add_option<GAME_OCR_IMAGES>(this);
         add_option<GAME_OUTPUT_WIDTH>(this);
+        add_option<GAME_OCR_ENCODING>(this);
+        add_option<GAME_OCR_SAMPLER>(this);
+        add_option<GAME_OCR_SAMPLER_FLOOR>(this);
+        add_option<GAME_OCR_TILE_NETWORKS>(this);
+        add_option<GAME_OCR_TILE_IMAGES>(this);
+        add_option<GAME_OCR_SURROGATE_SIZE>(this);
+        add_option<GAME_OCR_SURROGATE_THRESHOLD>(this);
+        add_option<GAME_OCR_TEST_LABELS>(this);
+        add_option<GAME_OCR_TEST_IMAGES>(this);
         
         // ea options
         add_option<REPRESENTATION_SIZE>(this);
         add_option<POPULATION_SIZE>(this);
         add_option<REPLACEMENT_RATE_P>(this);
+        add_option<ASYNC_THREADS>(this);
+        add_option<ASYNC_STALENESS>(this);
+        add_option<ASYNC_NUMA>(this);
         add_option<MUTATION_GENOMIC_P>(this);
         add_option<MUTATION_PER_SITE_P>(this);
         add_option<MUTATION_UNIFORM_INT_MAX>(this);
@@ -133,8 +291,13 @@ public:
         add_option<RUN_UPDATES>(this);
         add_option<RUN_EPOCHS>(this);
         add_option<CHECKPOINT_PREFIX>(this);
+        add_option<BINARY_CHECKPOINT_PERIOD>(this);
+        add_option<BINARY_CHECKPOINT_KEYFRAME>(this);
+        add_option<BINARY_CHECKPOINT_COMPRESS>(this);
+        add_option<BINARY_CHECKPOINT_UPDATE_OFFSET>(this);
         add_option<RNG_SEED>(this);
         add_option<RECORDING_PERIOD>(this);
+        add_option<TELEMETRY_SOCKET>(this);
         
         // analysis options
         add_option<ANALYSIS_INPUT>(this);
@@ -147,11 +310,21 @@ public:
         add_tool<hmm_reduced_graph>(this);
         add_tool<hmm_detailed_graph>(this);
         add_tool<hmm_causal_graph>(this);
+        add_tool<hmm_gate_profile>(this);
+        add_tool<binary_restart>(this);
     }
     
     virtual void gather_events(EA& ea) {
         add_event<datafiles::generation_fitness>(this, ea);
         add_event<mean_roc_trajectory>(this, ea);
+        add_event<generalization_trajectory>(this, ea);
+        add_event<hard_example_sampler>(this, ea);
+        add_event<binary_checkpoint>(this, ea);
+        if(get<GAME_OCR_SURROGATE_SIZE>(ea) > 0) {
+            add_event<surrogate_baseline>(this, ea);
+            add_event<surrogate_trajectory>(this, ea);
+        }
+        add_event<telemetry>(this, ea);
     };
 };
 LIBEA_CMDLINE_INSTANCE(ea_type, ocr);
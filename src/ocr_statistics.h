@@ -24,6 +24,49 @@
 #include <boost/accumulators/statistics/stats.hpp>
 #include <boost/accumulators/statistics/mean.hpp>
 #include <boost/accumulators/statistics/max.hpp>
+#include <boost/accumulators/statistics/count.hpp>
+
+/*! Mean ROC statistics of a population, and the max order param.  Individuals
+ that were screened out by the surrogate (see ocr_surrogate.h) only have probe
+ results, and are left out.
+ */
+struct population_roc {
+    population_roc() : mean_tpr(0.0), mean_fpr(0.0), mean_acc(0.0), mean_order(0.0), max_order(0.0) {
+    }
+    
+    //! Calculate the statistics for the population of ea.
+    template <typename EA>
+    population_roc(EA& ea) {
+        using namespace boost::accumulators;
+        accumulator_set<double, stats<tag::mean,tag::max,tag::count> > tpr, fpr, acc, order;
+        
+        for(typename EA::population_type::iterator i=ea.population().begin(); i!=ea.population().end(); ++i) {
+            if(get<OCR_SCREENED>(ind(i,ea))) {
+                continue;
+            }
+            tpr(get<OCR_TPR>(ind(i,ea)));
+            fpr(get<OCR_FPR>(ind(i,ea)));
+            acc(get<OCR_ACC>(ind(i,ea)));
+            order(get<OCR_ORDER>(ind(i,ea)));
+        }
+        if(count(order) == 0) {
+            *this = population_roc();
+            return;
+        }
+        mean_tpr = mean(tpr);
+        mean_fpr = mean(fpr);
+        mean_acc = mean(acc);
+        mean_order = mean(order);
+        max_order = max(order);
+    }
+    
+    double mean_tpr; //!< mean true positive rate
+    double mean_fpr; //!< mean false positive rate
+    double mean_acc; //!< mean accuracy
+    double mean_order; //!< mean order param
+    double max_order; //!< max order param
+};
+
 
 /*! Datafile for mean generation, and mean & max fitness.
  */
@@ -42,22 +85,13 @@ struct mean_roc_trajectory : record_statistics_event<EA> {
     }
     
     virtual void operator()(EA& ea) {
-        using namespace boost::accumulators;
-        accumulator_set<double, stats<tag::mean,tag::max> > tpr, fpr, acc, order;
-        
-        
-        for(typename EA::population_type::iterator i=ea.population().begin(); i!=ea.population().end(); ++i) {
-            tpr(get<OCR_TPR>(ind(i,ea)));
-            fpr(get<OCR_FPR>(ind(i,ea)));
-            acc(get<OCR_ACC>(ind(i,ea)));
-            order(get<OCR_ORDER>(ind(i,ea)));
-        }
+        population_roc p(ea);
         _df.write(ea.current_update())
-        .write(mean(tpr))
-        .write(mean(fpr))
-        .write(mean(acc))
-        .write(mean(order))
-        .write(max(order))
+        .write(p.mean_tpr)
+        .write(p.mean_fpr)
+        .write(p.mean_acc)
+        .write(p.mean_order)
+        .write(p.max_order)
         .endl();
     }
     
@@ -85,6 +119,9 @@ struct roc_trajectory : record_statistics_event<EA> {
         accumulator_set<double, stats<tag::mean> > tpr, fpr, acc;
         
         for(typename EA::population_type::iterator i=ea.population().begin(); i!=ea.population().end(); ++i) {
+            if(get<OCR_SCREENED>(ind(i,ea))) {
+                continue;
+            }
             tpr(get<OCR_TPR>(ind(i,ea)));
             fpr(get<OCR_FPR>(ind(i,ea)));
             acc(get<OCR_ACC>(ind(i,ea)));
@@ -0,0 +1,190 @@
+/* ocr_surrogate.h
+ * 
+ * This file is part of OCR.
+ * 
+ * Copyright 2012 David B. Knoester.
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _OCR_SURROGATE_H_
+#define _OCR_SURROGATE_H_
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <ea/meta_data.h>
+#include "ocr_game.h"
+
+LIBEA_MD_DECL(GAME_OCR_SURROGATE_SIZE, "game.ocr.surrogate.size", unsigned int);
+LIBEA_MD_DECL(GAME_OCR_SURROGATE_THRESHOLD, "game.ocr.surrogate.threshold", double);
+LIBEA_MD_DECL(OCR_PROBE, "individual.ocr.probe_fitness", double);
+
+/*! Surrogate model used to screen candidates before full evaluation.
+ 
+ The surrogate fitness of a candidate is its fitness on a small, fixed probe set
+ of images.  A candidate passes the screen if its surrogate fitness is at least
+ threshold times the mean surrogate fitness of the current population; only
+ those that pass are played on the full game.  Until the first baseline is set
+ (see surrogate_baseline), every candidate passes.  Candidates that are
+ screened out are given screened_fitness(), so that they never outrank a
+ candidate that was fully evaluated, and are marked with OCR_SCREENED, so that
+ their probe results are left out of the population's statistics.
+ 
+ Precision is the fraction of candidates that passed whose full fitness was at
+ least the mean fitness of the fully evaluated individuals in the population.
+ */
+class surrogate_model {
+public:
+    //! Statistics on the surrogate since the last call to reset_stats.
+    struct stats {
+        stats() : candidates(0), screened(0), passed(0), good(0) {
+        }
+        
+        unsigned long candidates; //!< number of candidates seen
+        unsigned long screened; //!< number screened out, i.e., full evaluations saved
+        unsigned long passed; //!< number that received a full evaluation
+        unsigned long good; //!< number that passed, and whose full fitness was above the mean
+    };
+    
+    //! Constructor.
+    surrogate_model() : _ready(false), _predicted(0.0), _actual(0.0), _mutex(new boost::mutex()) {
+    }
+    
+    /*! Returns the fitness of a candidate that was screened out.  Full fitness
+     is 1 + order, where order is in [-1,1], so this is the lowest fitness a full
+     evaluation can score.
+     */
+    static double screened_fitness() {
+        return 0.0;
+    }
+    
+    /*! Set the baseline that candidates are compared to: the population's mean
+     surrogate fitness, and the mean full fitness of its fully evaluated
+     individuals.
+     */
+    void rebase(double predicted, double actual) {
+        boost::mutex::scoped_lock lock(*_mutex);
+        _ready = true;
+        _predicted = predicted;
+        _actual = actual;
+    }
+    
+    //! Returns true if a candidate with the given surrogate fitness should be fully evaluated.
+    bool screen(double predicted, double threshold) {
+        boost::mutex::scoped_lock lock(*_mutex);
+        bool pass = !_ready || (predicted >= threshold * _predicted);
+        ++_stats.candidates;
+        ++_totals.candidates;
+        if(!pass) {
+            ++_stats.screened;
+            ++_totals.screened;
+        }
+        return pass;
+    }
+    
+    //! Record the full fitness of a candidate that passed the screen.
+    void observe(double actual) {
+        boost::mutex::scoped_lock lock(*_mutex);
+        ++_stats.passed;
+        ++_totals.passed;
+        if(actual >= _actual) {
+            ++_stats.good;
+            ++_totals.good;
+        }
+    }
+    
+    //! Returns the statistics since the last call, and resets them.
+    stats reset_stats() {
+        boost::mutex::scoped_lock lock(*_mutex);
+        stats s=_stats;
+        _stats = stats();
+        return s;
+    }
+    
+    //! Returns the statistics since the start of the run.
+    stats totals() {
+        boost::mutex::scoped_lock lock(*_mutex);
+        return _totals;
+    }
+    
+protected:
+    bool _ready; //!< true once a baseline has been set
+    double _predicted; //!< mean surrogate fitness of the population
+    double _actual; //!< mean full fitness of the population
+    stats _stats; //!< statistics since the last reset
+    stats _totals; //!< statistics since the start of the run
+    boost::shared_ptr<boost::mutex> _mutex; //!< protects all of the above
+};
+
+
+/*! Rebases the surrogate on the current population at the end of each update;
+ see surrogate_model.
+ */
+template <typename EA>
+struct surrogate_baseline : end_of_update_event<EA> {
+    surrogate_baseline(EA& ea) : end_of_update_event<EA>(ea) {
+    }
+    
+    virtual ~surrogate_baseline() {
+    }
+    
+    virtual void operator()(EA& ea) {
+        double predicted=0.0, actual=0.0;
+        std::size_t n=0;
+        for(typename EA::population_type::iterator i=ea.population().begin(); i!=ea.population().end(); ++i) {
+            predicted += get<OCR_PROBE>(ind(i,ea));
+            if(!get<OCR_SCREENED>(ind(i,ea))) {
+                actual += 1.0 + get<OCR_ORDER>(ind(i,ea));
+                ++n;
+            }
+        }
+        if(ea.population().empty()) {
+            return;
+        }
+        ea.fitness_function().surrogate.rebase(predicted / static_cast<double>(ea.population().size()),
+                                               (n > 0) ? (actual / static_cast<double>(n)) : 0.0);
+    }
+};
+
+
+/*! Datafile for surrogate precision and the number of evaluations saved.
+ */
+template <typename EA>
+struct surrogate_trajectory : record_statistics_event<EA> {
+    surrogate_trajectory(EA& ea) : record_statistics_event<EA>(ea), _df("surrogate.dat") {
+        _df.add_field("update")
+        .add_field("candidates", "number of candidates screened by the surrogate")
+        .add_field("evaluations", "number of full evaluations")
+        .add_field("saved", "number of full evaluations saved")
+        .add_field("precision", "fraction of full evaluations whose fitness was above the mean")
+        .add_field("screened_fitness", "fitness given to candidates that were screened out");
+    }
+    
+    virtual ~surrogate_trajectory() {
+    }
+    
+    virtual void operator()(EA& ea) {
+        surrogate_model::stats s=ea.fitness_function().surrogate.reset_stats();
+        _df.write(ea.current_update())
+        .write(s.candidates)
+        .write(s.passed)
+        .write(s.screened)
+        .write((s.passed > 0) ? static_cast<double>(s.good) / static_cast<double>(s.passed) : 0.0)
+        .write(surrogate_model::screened_fitness())
+        .endl();
+    }
+    
+    datafile _df;
+};
+
+#endif
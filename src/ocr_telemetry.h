@@ -0,0 +1,251 @@
+/* ocr_telemetry.h
+ *
+ * This file is part of OCR.
+ *
+ * Copyright 2012 David B. Knoester.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _OCR_TELEMETRY_H_
+#define _OCR_TELEMETRY_H_
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <ea/meta_data.h>
+#include <ea/exceptions.h>
+#include "ocr_statistics.h"
+
+LIBEA_MD_DECL(TELEMETRY_SOCKET, "ea.run.telemetry.socket", std::string);
+
+/*! A point-in-time view of a run, as served by the telemetry endpoint.
+ */
+struct telemetry_snapshot {
+    telemetry_snapshot() : update(0), uptime(0.0), updates_per_sec(0.0), evaluations(0), evaluations_per_sec(0.0),
+    candidates(0), screened(0), rss(0) {
+    }
+
+    unsigned long update; //!< current update
+    double uptime; //!< seconds since the first update
+    double updates_per_sec; //!< updates per second, over the last second or so
+    unsigned long evaluations; //!< number of full fitness evaluations
+    double evaluations_per_sec; //!< evaluations per second, over the last second or so
+    unsigned long candidates; //!< number of candidates seen by the surrogate, if any
+    unsigned long screened; //!< number of candidates screened out by the surrogate
+    population_roc roc; //!< population statistics, as of the last recording period
+    unsigned long rss; //!< resident set size, in bytes
+};
+
+
+/*! Hook for fitness functions to add their own counters to a snapshot; by
+ default, there are none.  Fitness functions that have them (e.g., a surrogate)
+ provide an overload.
+ */
+template <typename FitnessFunction>
+void telemetry_extras(FitnessFunction&, telemetry_snapshot&) {
+}
+
+
+/*! Live telemetry for a running EA, served over a Unix domain socket.
+
+ If ea.run.telemetry.socket names a path, a background thread listens there;
+ each connection is sent the most recent snapshot as "key value" lines, and
+ then closed, e.g.:
+   nc -U ocr.sock
+
+ The snapshot is published at the end of every update under a sequence lock:
+ the main thread never blocks or waits on a reader, readers instead retry if
+ they overlap a publish.  Population statistics (see ocr_statistics.h) and
+ memory use are only refreshed every recording period.
+ */
+template <typename EA>
+struct telemetry : end_of_update_event<EA> {
+    telemetry(EA& ea) : end_of_update_event<EA>(ea), _seq(0), _fd(-1), _stop(0), _window_update(0), _window_evaluations(0) {
+    }
+
+    virtual ~telemetry() {
+        if(_thread) {
+            __sync_lock_test_and_set(&_stop, 1);
+            _thread->join();
+            close(_fd);
+            unlink(_path.c_str());
+        }
+    }
+
+    virtual void operator()(EA& ea) {
+        if(get<TELEMETRY_SOCKET>(ea) == "none") {
+            return;
+        }
+        if(!_thread) {
+            listen(get<TELEMETRY_SOCKET>(ea));
+            _start = _window_start = boost::posix_time::microsec_clock::universal_time();
+        }
+
+        telemetry_snapshot s=_last;
+        boost::posix_time::ptime now=boost::posix_time::microsec_clock::universal_time();
+        s.update = ea.current_update();
+        s.uptime = static_cast<double>((now - _start).total_microseconds()) / 1e6;
+        s.evaluations = ea.fitness_function().game.plays();
+        telemetry_extras(ea.fitness_function(), s);
+
+        double dt=static_cast<double>((now - _window_start).total_microseconds()) / 1e6;
+        if(dt >= 1.0) {
+            s.updates_per_sec = static_cast<double>(s.update - _window_update) / dt;
+            s.evaluations_per_sec = static_cast<double>(s.evaluations - _window_evaluations) / dt;
+            _window_start = now;
+            _window_update = s.update;
+            _window_evaluations = s.evaluations;
+        }
+
+        if((ea.current_update() % get<RECORDING_PERIOD>(ea)) == 0) {
+            s.roc = population_roc(ea);
+            s.rss = resident_set_size();
+        }
+
+        publish(s);
+        _last = s;
+    }
+
+    //! Publish snapshot s; never blocks.
+    void publish(const telemetry_snapshot& s) {
+        __sync_fetch_and_add(&_seq, 1); // odd: publish in progress
+        __sync_synchronize();
+        _snapshot = s;
+        __sync_synchronize();
+        __sync_fetch_and_add(&_seq, 1); // even: consistent
+    }
+
+    //! Returns a consistent copy of the most recently published snapshot.
+    telemetry_snapshot read() {
+        telemetry_snapshot s;
+        for(;;) {
+            unsigned long before=__sync_fetch_and_add(&_seq, 0);
+            if(before & 0x1) {
+                boost::this_thread::yield();
+                continue;
+            }
+            __sync_synchronize();
+            s = _snapshot;
+            __sync_synchronize();
+            if(__sync_fetch_and_add(&_seq, 0) == before) {
+                return s;
+            }
+        }
+    }
+
+    //! Returns the resident set size of this process, in bytes, or 0 if unknown.
+    static unsigned long resident_set_size() {
+        std::ifstream statm("/proc/self/statm");
+        unsigned long size=0, resident=0;
+        if(statm >> size >> resident) {
+            return resident * static_cast<unsigned long>(sysconf(_SC_PAGESIZE));
+        }
+        return 0;
+    }
+
+    //! Open the socket at path, and start the server thread.
+    void listen(const std::string& path) {
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if(path.size() >= sizeof(addr.sun_path)) {
+            throw ea::bad_argument_exception("telemetry socket path too long: " + path);
+        }
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+
+        // remove a socket left over from a previous run, but nothing else; if
+        // path is any other kind of file, bind fails:
+        struct stat st;
+        if((lstat(path.c_str(), &st) == 0) && S_ISSOCK(st.st_mode)) {
+            unlink(path.c_str());
+        }
+        
+        _fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if((_fd < 0)
+           || (bind(_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+           || (::listen(_fd, 8) != 0)) {
+            throw ea::file_io_exception("could not open telemetry socket: " + path);
+        }
+        _path = path;
+        _thread.reset(new boost::thread(boost::bind(&telemetry::server, this)));
+    }
+
+    //! Server thread; answers connections until stopped.
+    void server() {
+        pollfd p;
+        p.fd = _fd;
+        p.events = POLLIN;
+        while(!__sync_fetch_and_add(&_stop, 0)) {
+            if(poll(&p, 1, 250) <= 0) {
+                continue;
+            }
+            int c=accept(_fd, 0, 0);
+            if(c < 0) {
+                continue;
+            }
+
+            telemetry_snapshot s=read();
+            std::ostringstream out;
+            out << "update " << s.update << "\n"
+            << "uptime " << s.uptime << "\n"
+            << "updates_per_sec " << s.updates_per_sec << "\n"
+            << "evaluations " << s.evaluations << "\n"
+            << "evaluations_per_sec " << s.evaluations_per_sec << "\n"
+            << "surrogate_candidates " << s.candidates << "\n"
+            << "surrogate_screened " << s.screened << "\n"
+            << "surrogate_screened_rate " << ((s.candidates > 0) ? static_cast<double>(s.screened) / static_cast<double>(s.candidates) : 0.0) << "\n"
+            << "mean_tpr " << s.roc.mean_tpr << "\n"
+            << "mean_fpr " << s.roc.mean_fpr << "\n"
+            << "mean_acc " << s.roc.mean_acc << "\n"
+            << "mean_order " << s.roc.mean_order << "\n"
+            << "max_order " << s.roc.max_order << "\n"
+            << "rss " << s.rss << "\n";
+
+            std::string msg=out.str();
+            for(std::size_t sent=0; sent < msg.size(); ) {
+                ssize_t n=send(c, msg.data()+sent, msg.size()-sent, MSG_NOSIGNAL);
+                if(n <= 0) {
+                    break;
+                }
+                sent += static_cast<std::size_t>(n);
+            }
+            close(c);
+        }
+    }
+
+    telemetry_snapshot _snapshot; //!< most recently published snapshot
+    volatile unsigned long _seq; //!< sequence lock for _snapshot; odd while publishing
+    telemetry_snapshot _last; //!< copy of the last snapshot, only touched by the main thread
+    std::string _path; //!< path of the socket
+    int _fd; //!< listening socket
+    int _stop; //!< non-zero when the server thread should exit
+    boost::posix_time::ptime _start; //!< time of the first update
+    boost::posix_time::ptime _window_start; //!< start of the current rate window
+    unsigned long _window_update; //!< update at the start of the current rate window
+    unsigned long _window_evaluations; //!< evaluations at the start of the current rate window
+    boost::scoped_ptr<boost::thread> _thread; //!< server thread
+};
+
+#endif